@@ -0,0 +1,226 @@
+#include "CalibBundle.h"
+
+#include "opencv2/calib3d.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+// File layout: BundleHeader, count BundleEntry records, then the matrix data,
+// each block starting on a 64-byte boundary so the maps are aligned in memory.
+static const char bundleMagic[8] = { 'S', 'T', 'C', 'A', 'L', 'B', 'N', 'D' };
+static const size_t bundleAlign = 64;
+
+struct BundleHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    int32_t width, height;
+    int32_t roi[8];             // roi1 then roi2 as x, y, width, height
+};
+
+struct BundleEntry
+{
+    char name[8];
+    int32_t type, rows, cols, reserved;
+    uint64_t offset, bytes;
+};
+
+static_assert(sizeof(BundleHeader) == 56, "bundle header layout");
+static_assert(sizeof(BundleEntry) == 40, "bundle entry layout");
+
+CalibBundle::~CalibBundle()
+{
+    unmap();
+}
+
+void CalibBundle::rectify(Size size)
+{
+    imageSize = size;
+    stereoRectify(M1, D1, M2, D2, size, R, T, R1, R2, P1, P2, Q,
+        CALIB_ZERO_DISPARITY, -1, size, &roi1, &roi2);
+    initUndistortRectifyMap(M1, D1, R1, P1, size, CV_16SC2, map11, map12);
+    initUndistortRectifyMap(M2, D2, R2, P2, size, CV_16SC2, map21, map22);
+}
+
+bool CalibBundle::save(const string& filename) const
+{
+    vector<pair<const char*, Mat> > entries;
+    const pair<const char*, const Mat*> all[] = {
+        { "M1", &M1 }, { "D1", &D1 }, { "M2", &M2 }, { "D2", &D2 }, { "R", &R }, { "T", &T },
+        { "R1", &R1 }, { "R2", &R2 }, { "P1", &P1 }, { "P2", &P2 }, { "Q", &Q },
+        { "map11", &map11 }, { "map12", &map12 }, { "map21", &map21 }, { "map22", &map22 }
+    };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        if (!all[i].second->empty())
+            entries.push_back(make_pair(all[i].first, all[i].second->isContinuous() ? *all[i].second : all[i].second->clone()));
+
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bundleMagic, sizeof(bundleMagic));
+    header.version = formatVersion;
+    header.count = (uint32_t)entries.size();
+    header.width = imageSize.width;
+    header.height = imageSize.height;
+    const Rect rois[2] = { roi1, roi2 };
+    for (int k = 0; k < 2; k++) {
+        header.roi[k * 4] = rois[k].x;
+        header.roi[k * 4 + 1] = rois[k].y;
+        header.roi[k * 4 + 2] = rois[k].width;
+        header.roi[k * 4 + 3] = rois[k].height;
+    }
+
+    vector<BundleEntry> table(entries.size());
+    uint64_t offset = sizeof(BundleHeader) + table.size() * sizeof(BundleEntry);
+    for (size_t i = 0; i < entries.size(); i++) {
+        const Mat& m = entries[i].second;
+        BundleEntry& e = table[i];
+        memset(&e, 0, sizeof(e));
+        strncpy(e.name, entries[i].first, sizeof(e.name));
+        e.type = m.type();
+        e.rows = m.rows;
+        e.cols = m.cols;
+        offset = (offset + bundleAlign - 1) / bundleAlign * bundleAlign;
+        e.offset = offset;
+        e.bytes = (uint64_t)m.total() * m.elemSize();
+        offset += e.bytes;
+    }
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not write calibration bundle %s\n", filename.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        (table.empty() || fwrite(table.data(), sizeof(BundleEntry), table.size(), fp) == table.size());
+    uint64_t pos = sizeof(BundleHeader) + table.size() * sizeof(BundleEntry);
+    static const char zeros[bundleAlign] = {};
+    for (size_t i = 0; ok && i < entries.size(); i++) {
+        ok = fwrite(zeros, 1, (size_t)(table[i].offset - pos), fp) == table[i].offset - pos &&
+            fwrite(entries[i].second.data, 1, (size_t)table[i].bytes, fp) == table[i].bytes;
+        pos = table[i].offset + table[i].bytes;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "Error writing calibration bundle %s\n", filename.c_str());
+    return ok;
+}
+
+bool CalibBundle::load(const string& filename)
+{
+    unmap();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = NULL;
+    const void* view = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping)
+        view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_ = file;
+    mapping_ = mapping;
+    data_ = (const uchar*)view;
+    size_ = (size_t)fileSize.QuadPart;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* view = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+        return false;
+    data_ = (const uchar*)view;
+    size_ = (size_t)st.st_size;
+#endif
+
+    BundleHeader header;
+    if (size_ < sizeof(header)) {
+        fprintf(stderr, "%s is not a calibration bundle\n", filename.c_str());
+        unmap();
+        return false;
+    }
+    memcpy(&header, data_, sizeof(header));
+    if (memcmp(header.magic, bundleMagic, sizeof(bundleMagic)) != 0 || header.version != formatVersion ||
+        size_ < sizeof(header) + (uint64_t)header.count * sizeof(BundleEntry)) {
+        fprintf(stderr, "%s is not a version %u calibration bundle\n", filename.c_str(), formatVersion);
+        unmap();
+        return false;
+    }
+
+    imageSize = Size(header.width, header.height);
+    roi1 = Rect(header.roi[0], header.roi[1], header.roi[2], header.roi[3]);
+    roi2 = Rect(header.roi[4], header.roi[5], header.roi[6], header.roi[7]);
+
+    const pair<const char*, Mat*> all[] = {
+        { "M1", &M1 }, { "D1", &D1 }, { "M2", &M2 }, { "D2", &D2 }, { "R", &R }, { "T", &T },
+        { "R1", &R1 }, { "R2", &R2 }, { "P1", &P1 }, { "P2", &P2 }, { "Q", &Q },
+        { "map11", &map11 }, { "map12", &map12 }, { "map21", &map21 }, { "map22", &map22 }
+    };
+    for (uint32_t i = 0; i < header.count; i++) {
+        BundleEntry e;
+        memcpy(&e, data_ + sizeof(header) + i * sizeof(BundleEntry), sizeof(e));
+        if (e.rows < 0 || e.cols < 0 || e.offset > size_ || e.bytes > size_ - e.offset ||
+            e.bytes != (uint64_t)e.rows * e.cols * CV_ELEM_SIZE(e.type)) {
+            fprintf(stderr, "Corrupt entry %d in calibration bundle %s\n", (int)i, filename.c_str());
+            unmap();
+            return false;
+        }
+        string name(e.name, strnlen(e.name, sizeof(e.name)));
+        for (size_t k = 0; k < sizeof(all) / sizeof(all[0]); k++) {
+            if (name != all[k].first)
+                continue;
+            Mat view(e.rows, e.cols, e.type, (void*)(data_ + e.offset));
+            // Only the maps are large enough to be worth keeping as views.
+            *all[k].second = name.compare(0, 3, "map") == 0 ? view : view.clone();
+            break;
+        }
+    }
+    return true;
+}
+
+void CalibBundle::unmap()
+{
+    map11.release();
+    map12.release();
+    map21.release();
+    map22.release();
+    if (!data_)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+    CloseHandle((HANDLE)mapping_);
+    CloseHandle((HANDLE)file_);
+    file_ = mapping_ = nullptr;
+#else
+    munmap((void*)data_, size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <stdint.h>
+#include <string>
+
+// Stereo calibration in a single versioned binary file: the intrinsics and
+// extrinsics that are otherwise spread over intrinsics.yml/extrinsics.yml,
+// the rectification derived from them, and the rectification maps for the
+// calibrated image size.
+//
+// load() memory-maps the file. The small matrices are copied out, the maps
+// stay views into the mapping, so opening a bundle costs a few page faults
+// instead of parsing YAML and recomputing the maps. The bundle therefore
+// must outlive any Mat that shares map11..map22.
+//
+// The file is written in the byte order of the machine that wrote it. There is
+// no byte-order marker: the magic reads the same either way, and a file from
+// a machine of the other byte order is only rejected because its version
+// field no longer matches.
+class CalibBundle
+{
+public:
+    static const uint32_t formatVersion = 1;
+
+    cv::Size imageSize;
+    cv::Mat M1, D1, M2, D2;         // camera matrices and distortion
+    cv::Mat R, T;                   // right camera relative to the left
+    cv::Mat R1, R2, P1, P2, Q;      // stereoRectify output
+    cv::Rect roi1, roi2;            // valid rectified pixels
+    cv::Mat map11, map12, map21, map22;     // CV_16SC2 / CV_16UC1 remap tables
+
+    CalibBundle() {}
+    ~CalibBundle();
+    CalibBundle(const CalibBundle&) = delete;
+    CalibBundle& operator=(const CalibBundle&) = delete;
+
+    // Fills R1..Q, the ROIs and the maps from M1/D1/M2/D2/R/T for the given
+    // image size, with the stereoRectify settings the matcher uses
+    // (CALIB_ZERO_DISPARITY, default alpha).
+    void rectify(cv::Size size);
+
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
+
+private:
+    void unmap();
+
+    const uchar* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
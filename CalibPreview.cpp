@@ -0,0 +1,83 @@
+#include "CalibPreview.h"
+
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/highgui.hpp"
+
+#include <stdio.h>
+#include <filesystem>
+
+using namespace cv;
+using namespace std;
+
+// At most this many previews wait for the writer; show() blocks beyond that so
+// a slow disk cannot make memory grow with the number of views.
+static const size_t maxQueuedPreviews = 8;
+
+PreviewSink::PreviewSink(Mode mode, const string& dir)
+    : mode_(mode), dir_(dir), stop_(false)
+{
+    if (mode_ != DISK)
+        return;
+    if (dir_.empty())
+        dir_ = ".";
+    error_code ec;
+    filesystem::create_directories(dir_, ec);
+    if (ec)
+    {
+        fprintf(stderr, "Could not create preview directory %s (%s), previews are disabled\n",
+            dir_.c_str(), ec.message().c_str());
+        mode_ = NONE;
+        return;
+    }
+    writer_ = thread(&PreviewSink::writerLoop, this);
+}
+
+PreviewSink::~PreviewSink()
+{
+    if (!writer_.joinable())
+        return;
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    writer_.join();
+}
+
+int PreviewSink::show(const string& name, const Mat& img, int delayMs)
+{
+    if (mode_ == WINDOW)
+    {
+        imshow(name, img);
+        return waitKey(delayMs);
+    }
+    if (mode_ != DISK || img.empty())
+        return -1;
+
+    unique_lock<mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return queue_.size() < maxQueuedPreviews; });
+    string filename = format("%s/%s_%d.png", dir_.c_str(), name.c_str(), counters_[name]++);
+    queue_.push_back(make_pair(filename, img.clone()));
+    lock.unlock();
+    cond_.notify_all();
+    return -1;
+}
+
+void PreviewSink::writerLoop()
+{
+    unique_lock<mutex> lock(mutex_);
+    for (;;)
+    {
+        cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty())
+            break;
+        pair<string, Mat> item = queue_.front();
+        queue_.pop_front();
+        cond_.notify_all();
+
+        lock.unlock();
+        if (!imwrite(item.first, item.second))
+            fprintf(stderr, "Could not write preview %s\n", item.first.c_str());
+        lock.lock();
+    }
+}
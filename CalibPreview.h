@@ -0,0 +1,50 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+// Destination for the preview images the calibration tools produce (detected
+// corners, rectified pairs, undistorted views). The calibration itself never
+// depends on it, so it can run unattended:
+//   WINDOW - HighGUI windows, as the tools always did
+//   DISK   - PNG files written by a background thread; show() only queues
+//   NONE   - previews are dropped and nothing is rendered
+class PreviewSink
+{
+public:
+    enum Mode { NONE, WINDOW, DISK };
+
+    // dir is only used in DISK mode and is created if missing. If it cannot
+    // be created the error is reported once and the sink falls back to NONE.
+    // The destructor writes whatever is still queued.
+    explicit PreviewSink(Mode mode = WINDOW, const std::string& dir = std::string());
+    ~PreviewSink();
+
+    Mode mode() const { return mode_; }
+    // False in NONE mode; callers can skip building the preview entirely.
+    bool active() const { return mode_ != NONE; }
+
+    // WINDOW: imshow + waitKey(delayMs) (0 waits for a key) and returns the key.
+    // DISK: queues a copy of img as <dir>/<name>_<n>.png and returns -1.
+    // NONE: returns -1.
+    int show(const std::string& name, const cv::Mat& img, int delayMs);
+
+private:
+    void writerLoop();
+
+    Mode mode_;
+    std::string dir_;
+    std::map<std::string, int> counters_;
+    std::deque<std::pair<std::string, cv::Mat> > queue_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_;
+    std::thread writer_;
+};
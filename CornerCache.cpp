@@ -0,0 +1,108 @@
+#include "CornerCache.h"
+
+#include <stdio.h>
+#include <fstream>
+#include <iterator>
+
+using namespace cv;
+using namespace std;
+
+static uint64 fnv1a(const uchar* data, size_t size, uint64 hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+CornerCache::CornerCache(const string& filename) : filename_(filename), dirty_(false)
+{
+    if (filename_.empty())
+        return;
+
+    FileStorage fs(filename_, FileStorage::READ);
+    if (!fs.isOpened())
+        return;
+
+    FileNode entries = fs["entries"];
+    for (FileNodeIterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        FileNode node = *it;
+        Entry entry;
+        Mat corners;
+        entry.found = (int)node["found"] != 0;
+        entry.imageSize = Size((int)node["width"], (int)node["height"]);
+        node["corners"] >> corners;
+        if (!corners.empty())
+            corners.reshape(2, 1).copyTo(entry.corners);
+        if (!node["ids"].empty())
+            node["ids"] >> entry.ids;
+        entries_[(string)node["key"]] = entry;
+    }
+    printf("Loaded %d cached board detections from %s\n", (int)entries_.size(), filename_.c_str());
+}
+
+string CornerCache::fileKey(const string& imageFile, const string& params, vector<uchar>& bytes)
+{
+    ifstream in(imageFile, ios::binary);
+    if (!in.is_open())
+        return string();
+    bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+
+    uint64 contentHash = fnv1a(bytes.data(), bytes.size());
+    uint64 paramsHash = fnv1a((const uchar*)params.data(), params.size());
+    return format("%016llx_%08llx_%016llx", (unsigned long long)contentHash,
+                  (unsigned long long)bytes.size(), (unsigned long long)paramsHash);
+}
+
+bool CornerCache::lookup(const string& key, Entry& entry) const
+{
+    lock_guard<mutex> lock(mutex_);
+    map<string, Entry>::const_iterator it = entries_.find(key);
+    if (it == entries_.end())
+        return false;
+    entry = it->second;
+    return true;
+}
+
+void CornerCache::store(const string& key, const Entry& entry)
+{
+    if (!enabled())
+        return;
+    lock_guard<mutex> lock(mutex_);
+    entries_[key] = entry;
+    dirty_ = true;
+}
+
+bool CornerCache::save() const
+{
+    lock_guard<mutex> lock(mutex_);
+    if (!enabled() || !dirty_)
+        return true;
+
+    FileStorage fs(filename_, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        fprintf(stderr, "Could not write corner cache %s\n", filename_.c_str());
+        return false;
+    }
+    fs << "entries" << "[";
+    for (map<string, Entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+    {
+        const Entry& entry = it->second;
+        fs << "{" << "key" << it->first
+           << "found" << (int)entry.found
+           << "width" << entry.imageSize.width
+           << "height" << entry.imageSize.height;
+        if (!entry.corners.empty())
+            fs << "corners" << Mat(entry.corners);
+        if (!entry.ids.empty())
+            fs << "ids" << entry.ids;
+        fs << "}";
+    }
+    fs << "]";
+    printf("Saved %d board detections to %s\n", (int)entries_.size(), filename_.c_str());
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Persistent store of calibration board detections. Entries are keyed by the
+// image file content plus a string describing the board and detector settings,
+// so re-running a calibration with other solver flags or another subset of
+// views skips corner detection for every image seen before.
+//
+// lookup() and store() may be called concurrently from detection threads.
+class CornerCache
+{
+public:
+    struct Entry
+    {
+        bool found = false;
+        cv::Size imageSize;
+        std::vector<cv::Point2f> corners;
+        std::vector<int> ids;       // ChArUco corner ids, empty for other patterns
+    };
+
+    // An empty filename gives a disabled cache: lookups miss, save() does nothing.
+    explicit CornerCache(const std::string& filename = std::string());
+
+    bool enabled() const { return !filename_.empty(); }
+
+    // Reads imageFile into bytes and returns its cache key for the given
+    // detector parameters, or an empty string if the file cannot be read.
+    // The bytes can be handed to cv::imdecode so the file is read only once.
+    static std::string fileKey(const std::string& imageFile, const std::string& params,
+                               std::vector<uchar>& bytes);
+
+    bool lookup(const std::string& key, Entry& entry) const;
+    void store(const std::string& key, const Entry& entry);
+
+    // Writes the cache back if anything was stored since it was loaded.
+    bool save() const;
+
+private:
+    std::string filename_;
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    bool dirty_;
+};
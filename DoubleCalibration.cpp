@@ -25,6 +25,10 @@
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
 #include "opencv2/objdetect/charuco_detector.hpp"
+#include "CornerCache.h"
+#include "CalibPreview.h"
+#include "CalibBundle.h"
+#include "ViewRejection.h"
 
 #include <vector>
 #include <string>
@@ -53,6 +57,15 @@ static int print_help(char** argv)
     cout << "Usage:\n " << argv[0] << " -w=<board_width default=9> -h=<board_height default=6>"
         << " -t=<pattern type: chessboard or charucoboard default=chessboard> -s=<square_size default=1.0> -ms=<marker size default=0.5>"
         << " -ad=<predefined aruco dictionary name default=DICT_4X4_50> -adf=<aruco dictionary file default=None>"
+        << " -cache=<corner detection cache file, e.g. corners.yml>"
+        << " -pyr (search chessboards on a downsampled image first)"
+        << " -report=<per-view error report .yml/.xml/.json>"
+        << " -joint (calibrate both cameras from the same detections and write left_camera.yml/right_camera.yml"
+        << " instead of loading them)"
+        << " -bundle=<binary calibration bundle, default calib_bundle.bin, empty to skip>"
+        << " -headless (no windows or key waits)"
+        << " -preview-dir=<dir> (write corner and rectified previews to <dir> as PNG instead of showing them)"
+        << " -reject=<k> (drop pairs above median + k*MAD of the per-view error and re-solve, 0 disables)"
         << " <image list XML/YML file default=stereo_calib.xml>\n" << endl;
     cout << "Available Aruco dictionaries: DICT_4X4_50, DICT_4X4_100, DICT_4X4_250, "
         << "DICT_4X4_1000, DICT_5X5_50, DICT_5X5_100, DICT_5X5_250, DICT_5X5_1000, "
@@ -63,9 +76,240 @@ static int print_help(char** argv)
     return 0;
 }
 
+struct BoardDetection
+{
+    Size imageSize;     // empty if the image could not be read
+    bool found = false;
+    vector<Point2f> corners;
+    vector<int> ids;    // ChArUco corner ids
+};
+
+static const TermCriteria subPixCriteria(TermCriteria::COUNT + TermCriteria::EPS, 30, 0.01);
+
+// Locates the chessboard on a downsampled copy with CALIB_CB_FAST_CHECK and
+// refines the upscaled corners with cornerSubPix at full resolution, which only
+// touches the pixels around each corner. Returns false (leaving the caller to
+// run the full-resolution search) if the board is not found or the refinement
+// moves a corner further than the coarse estimate can be off.
+static bool findChessboardPyramid(const Mat& img, Size boardSize, vector<Point2f>& corners)
+{
+    const int maxSearchDim = 960;
+    double sf = (double)maxSearchDim / MAX(img.cols, img.rows);
+    if (sf >= 1)
+        return false;
+
+    Mat small;
+    resize(img, small, Size(), sf, sf, INTER_AREA);
+    vector<Point2f> coarse;
+    if (!findChessboardCorners(small, boardSize, coarse,
+        CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_NORMALIZE_IMAGE | CALIB_CB_FAST_CHECK))
+        return false;
+
+    for (size_t n = 0; n < coarse.size(); n++)
+        coarse[n] = Point2f((float)((coarse[n].x + 0.5) / sf - 0.5), (float)((coarse[n].y + 0.5) / sf - 0.5));
+    corners = coarse;
+    cornerSubPix(img, corners, Size(11, 11), Size(-1, -1), subPixCriteria);
+
+    const double maxShift = 2. / sf + 2;
+    for (size_t n = 0; n < corners.size(); n++)
+        if (norm(corners[n] - coarse[n]) > maxShift)
+            return false;
+    return true;
+}
+
+// Finds the board at scale 1 and, failing that, on upscaled copies up to
+// maxScale. Chessboard corners are refined with cornerSubPix at full resolution.
+// With pyramidFirst the downsampled search is tried before all of that.
+static void detectBoardCorners(const Mat& img, const string& type, Size boardSizeInnerCorners,
+    const cv::aruco::CharucoDetector& ch_detector, int maxScale, bool pyramidFirst, BoardDetection& det)
+{
+    det.imageSize = img.size();
+    if (pyramidFirst && type == "chessboard" && findChessboardPyramid(img, boardSizeInnerCorners, det.corners))
+    {
+        det.found = true;
+        return;
+    }
+    for (int scale = 1; scale <= maxScale; scale++)
+    {
+        Mat timg;
+        if (scale == 1)
+            timg = img;
+        else
+            resize(img, timg, Size(), scale, scale, INTER_LINEAR_EXACT);
+
+        if (type == "chessboard") {
+            det.found = findChessboardCorners(timg, boardSizeInnerCorners, det.corners,
+                CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_NORMALIZE_IMAGE);
+        }
+        else {
+            ch_detector.detectBoard(timg, det.corners, det.ids);
+            det.found = det.corners.size() == (size_t)(boardSizeInnerCorners.height * boardSizeInnerCorners.width);
+        }
+        if (det.found)
+        {
+            if (scale > 1)
+            {
+                Mat cornersMat(det.corners);
+                cornersMat *= 1. / scale;
+            }
+            break;
+        }
+    }
+    if (det.found && type == "chessboard") {
+        cornerSubPix(img, det.corners, Size(11, 11), Size(-1, -1), subPixCriteria);
+    }
+}
+
+// Checks the epipolar constraint m2^t*F*m1=0 for all views in one batch: the
+// points of every view are concatenated so undistortion, epiline computation
+// and the error reduction each run once over the whole set. perViewError gets
+// the mean per-point error (distance to the left plus the right epiline).
+static double computeEpipolarErrors(const vector<vector<Point2f> > imagePoints[2],
+    const Mat cameraMatrix[2], const Mat distCoeffs[2], const Mat& F, vector<double>& perViewError)
+{
+    int nviews = (int)imagePoints[0].size();
+    vector<int> offsets(nviews + 1, 0);
+    for (int i = 0; i < nviews; i++)
+        offsets[i + 1] = offsets[i] + (int)imagePoints[0][i].size();
+    int total = offsets[nviews];
+    perViewError.assign(nviews, 0.0);
+    if (total == 0)
+        return 0;
+
+    Mat homog[2], lines[2];
+    for (int k = 0; k < 2; k++)
+    {
+        Mat all(total, 1, CV_32FC2), undistorted;
+        for (int i = 0; i < nviews; i++)
+            Mat(imagePoints[k][i]).copyTo(all.rowRange(offsets[i], offsets[i + 1]));
+        undistortPoints(all, undistorted, cameraMatrix[k], distCoeffs[k], noArray(), cameraMatrix[k]);
+        computeCorrespondEpilines(undistorted, k + 1, F, lines[k]);
+        convertPointsToHomogeneous(undistorted, homog[k]);
+    }
+
+    // |l . (x, y, 1)| for each point against the epiline from the other camera.
+    Mat err = Mat::zeros(total, 1, CV_32F);
+    for (int k = 0; k < 2; k++)
+    {
+        Mat prod = homog[k].mul(lines[1 - k]), dot;
+        reduce(prod.reshape(1, total), dot, 1, REDUCE_SUM);
+        err += abs(dot);
+    }
+
+    for (int i = 0; i < nviews; i++)
+    {
+        int n = offsets[i + 1] - offsets[i];
+        if (n > 0)
+            perViewError[i] = sum(err.rowRange(offsets[i], offsets[i + 1]))[0] / n;
+    }
+    return sum(err)[0] / total;
+}
+
+// Prints one line per stereo view and, if filename is set, writes the same
+// data with FileStorage (format from the extension: .yml, .xml or .json).
+// perViewErrors is the nviews x 2 RMS reprojection error from stereoCalibrate.
+static void reportViewErrors(const string& filename, const vector<string>& goodImageList,
+    const vector<double>& epipolarErrors, const Mat& perViewErrors, double rms, double avgEpipolarErr)
+{
+    int nviews = (int)epipolarErrors.size();
+    printf("%-4s %-10s %-10s %-10s %s\n", "view", "epipolar", "rms_left", "rms_right", "images");
+    for (int i = 0; i < nviews; i++)
+        printf("%-4d %-10.4f %-10.4f %-10.4f %s %s\n", i, epipolarErrors[i],
+            perViewErrors.at<double>(i, 0), perViewErrors.at<double>(i, 1),
+            goodImageList[i * 2].c_str(), goodImageList[i * 2 + 1].c_str());
+
+    if (filename.empty())
+        return;
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        cout << "Error: can not save the per-view report to " << filename << "\n";
+        return;
+    }
+    fs << "rms" << rms << "avg_epipolar_err" << avgEpipolarErr;
+    fs << "views" << "[";
+    for (int i = 0; i < nviews; i++)
+    {
+        fs << "{" << "left" << goodImageList[i * 2] << "right" << goodImageList[i * 2 + 1]
+            << "epipolar_err" << epipolarErrors[i]
+            << "rms_left" << perViewErrors.at<double>(i, 0)
+            << "rms_right" << perViewErrors.at<double>(i, 1) << "}";
+    }
+    fs << "]";
+    cout << "Saved per-view report to " << filename << endl;
+}
+
+// Calibrates camera cam (0 = left, 1 = right) from every image of that camera
+// where the board was found, not only from the complete pairs, and saves the
+// result with the keys main6 writes so the file can be used on its own.
+static bool calibrateSingleCamera(const vector<BoardDetection>& detections, int cam, Size imageSize,
+    Size boardSizeInnerCorners, float squareSize, const string& filename, Mat& cameraMatrix, Mat& distCoeffs)
+{
+    vector<Point3f> board;
+    for (int j = 0; j < boardSizeInnerCorners.height; j++)
+        for (int k = 0; k < boardSizeInnerCorners.width; k++)
+            board.push_back(Point3f(k * squareSize, j * squareSize, 0));
+
+    vector<vector<Point2f> > imagePoints;
+    for (size_t n = cam; n < detections.size(); n += 2)
+        if (detections[n].found && detections[n].imageSize == imageSize)
+            imagePoints.push_back(detections[n].corners);
+    if (imagePoints.size() < 3)
+    {
+        cout << "Error: too few views to calibrate " << filename << "\n";
+        return false;
+    }
+    vector<vector<Point3f> > objectPoints(imagePoints.size(), board);
+
+    int flags = CALIB_FIX_K3;
+    vector<Mat> rvecs, tvecs;
+    cameraMatrix = Mat::eye(3, 3, CV_64F);
+    distCoeffs = Mat::zeros(8, 1, CV_64F);
+    double rms = calibrateCamera(objectPoints, imagePoints, imageSize, cameraMatrix, distCoeffs,
+        rvecs, tvecs, flags | CALIB_USE_LU);
+    if (!checkRange(cameraMatrix) || !checkRange(distCoeffs))
+    {
+        cout << "Error: calibration of " << filename << " failed\n";
+        return false;
+    }
+
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        cout << "Error: can not save " << filename << "\n";
+        return false;
+    }
+    fs << "nframes" << (int)imagePoints.size();
+    fs << "image_width" << imageSize.width;
+    fs << "image_height" << imageSize.height;
+    fs << "board_width" << boardSizeInnerCorners.width;
+    fs << "board_height" << boardSizeInnerCorners.height;
+    fs << "square_size" << squareSize;
+    fs << "flags" << flags;
+    fs << "camera_matrix" << cameraMatrix;
+    fs << "distortion_coefficients" << distCoeffs;
+    fs << "avg_reprojection_error" << rms;
+    cout << "Calibrated " << filename << " from " << imagePoints.size() << " views, RMS error=" << rms << endl;
+    return true;
+}
+
+struct StereoCalibOptions
+{
+    string cacheFile;           // corner detection cache, empty to disable
+    bool pyramidFirst = false;  // try the downsampled chessboard search first
+    string reportFile;          // per-view error report, empty to only print it
+    double rejectK = 0;         // outlier view rejection threshold in MADs, 0 disables
+    PreviewSink::Mode previewMode = PreviewSink::WINDOW;
+    string previewDir;          // where DISK previews are written
+    bool calibrateIntrinsics = false;   // calibrate both cameras here instead of loading *_camera.yml
+    string bundleFile = "calib_bundle.bin";     // binary calibration bundle, empty to skip
+    bool displayCorners = false;
+    bool useCalibrated = true;
+    bool showRectified = true;
+};
 
 static void
-StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, float squareSize, float markerSize, cv::aruco::PredefinedDictionaryType arucoDict, string arucoDictFile, bool displayCorners = false, bool useCalibrated = true, bool showRectified = true)
+StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, float squareSize, float markerSize, cv::aruco::PredefinedDictionaryType arucoDict, string arucoDictFile, const StereoCalibOptions& opts)
 {
     if (imagelist.size() % 2 != 0)
     {
@@ -115,77 +359,84 @@ StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, f
     }
     cv::aruco::CharucoBoard ch_board(boardSizeUnits, squareSize, markerSize, dictionary);
     cv::aruco::CharucoDetector ch_detector(ch_board);
-    std::vector<int> markerIds;
+
+    // Detection is independent per image, so run it for the whole list in
+    // parallel first; the pairing below then walks the results in list order
+    // exactly like the serial version did.
+    // Detections are cached by image content and everything that influences
+    // the detector, so reruns with other solver settings skip this step.
+    PreviewSink preview(opts.previewMode, opts.previewDir);
+    CornerCache cache(opts.cacheFile);
+    string detectParams = format("stereo|%s|%dx%d|scale%d|subpix11|pyr%d", type.c_str(),
+        boardSizeInnerCorners.width, boardSizeInnerCorners.height, maxScale, (int)opts.pyramidFirst);
+    if (type == "charucoboard")
+        detectParams += format("|%g|%g|%d|%s", squareSize, markerSize, (int)arucoDict, arucoDictFile.c_str());
+
+    vector<BoardDetection> detections(imagelist.size());
+    parallel_for_(Range(0, (int)imagelist.size()), [&](const Range& range) {
+        for (int n = range.start; n < range.end; n++)
+        {
+            BoardDetection& det = detections[n];
+            vector<uchar> bytes;
+            string key = cache.enabled() ? CornerCache::fileKey(imagelist[n], detectParams, bytes) : string();
+            CornerCache::Entry entry;
+            if (!key.empty() && cache.lookup(key, entry))
+            {
+                det.imageSize = entry.imageSize;
+                det.found = entry.found;
+                det.corners = entry.corners;
+                det.ids = entry.ids;
+                continue;
+            }
+
+            Mat img = bytes.empty() ? imread(imagelist[n], IMREAD_GRAYSCALE) : imdecode(bytes, IMREAD_GRAYSCALE);
+            if (img.empty())
+                continue;
+            detectBoardCorners(img, type, boardSizeInnerCorners, ch_detector, maxScale, opts.pyramidFirst, det);
+            if (!key.empty())
+            {
+                entry.imageSize = det.imageSize;
+                entry.found = det.found;
+                entry.corners = det.corners;
+                entry.ids = det.ids;
+                cache.store(key, entry);
+            }
+        }
+    });
+    cache.save();
 
     for (i = j = 0; i < nimages; i++)
     {
         for (k = 0; k < 2; k++)
         {
             const string& filename = imagelist[i * 2 + k];
-            Mat img = imread(filename, IMREAD_GRAYSCALE);
-            if (img.empty())
+            const BoardDetection& det = detections[i * 2 + k];
+            if (det.imageSize == Size())
                 break;
             if (imageSize == Size())
-                imageSize = img.size();
-            else if (img.size() != imageSize)
+                imageSize = det.imageSize;
+            else if (det.imageSize != imageSize)
             {
                 cout << "The image " << filename << " has the size different from the first image size. Skipping the pair\n";
                 break;
             }
-            bool found = false;
-            vector<Point2f>& corners = imagePoints[k][j];
-            for (int scale = 1; scale <= maxScale; scale++)
-            {
-                Mat timg;
-                if (scale == 1)
-                    timg = img;
-                else
-                    resize(img, timg, Size(), scale, scale, INTER_LINEAR_EXACT);
-
-                if (type == "chessboard") {
-                    found = findChessboardCorners(timg, boardSizeInnerCorners, corners,
-                        CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_NORMALIZE_IMAGE);
-                }
-                else if (type == "charucoboard") {
-                    ch_detector.detectBoard(timg, corners, markerIds);
-                    found = corners.size() == (size_t)(boardSizeInnerCorners.height * boardSizeInnerCorners.width);
-                }
-                else {
-                    cout << "Error: unknown pattern " << type << "\n";
-                    return;
-                }
-                if (found)
-                {
-                    if (scale > 1)
-                    {
-                        Mat cornersMat(corners);
-                        cornersMat *= 1. / scale;
-                    }
-                    break;
-                }
-            }
-            if (displayCorners)
+            if (opts.displayCorners && preview.active())
             {
                 cout << filename << endl;
-                Mat cimg, cimg1;
+                Mat img = imread(filename, IMREAD_GRAYSCALE), cimg, cimg1;
                 cvtColor(img, cimg, COLOR_GRAY2BGR);
-                drawChessboardCorners(cimg, boardSizeInnerCorners, corners, found);
+                drawChessboardCorners(cimg, boardSizeInnerCorners, det.corners, det.found);
                 double sf = 640. / MAX(img.rows, img.cols);
                 resize(cimg, cimg1, Size(), sf, sf, INTER_LINEAR_EXACT);
-                imshow("corners", cimg1);
-                char c = (char)waitKey(500);
+                char c = (char)preview.show("corners", cimg1, 500);
                 if (c == 27 || c == 'q' || c == 'Q') //Allow ESC to quit
                     exit(-1);
             }
             else
                 putchar('.');
-            if (!found)
+            if (!det.found)
                 break;
-            if (type == "chessboard") {
-                cornerSubPix(img, corners, Size(11, 11), Size(-1, -1),
-                    TermCriteria(TermCriteria::COUNT + TermCriteria::EPS,
-                        30, 0.01));
-            }
+            imagePoints[k][j] = det.corners;
         }
         if (k == 2)
         {
@@ -218,34 +469,52 @@ StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, f
     // ===========================================
     Mat cameraMatrix[2], distCoeffs[2];
 
-    // ڲ
-    string leftIntrinsicsFile = "left_camera.yml";
+    if (opts.calibrateIntrinsics)
     {
-        FileStorage fs(leftIntrinsicsFile, FileStorage::READ);
-        if (!fs.isOpened()) {
-            cerr << ": ޷ڲļ " << leftIntrinsicsFile << endl;
-            cerr << "ȷļͬһĿ¼" << endl;
+        // Both cameras are calibrated in parallel from the detections made
+        // above and saved to the files the other branch loads, so a later
+        // run without -joint picks them up.
+        bool ok[2] = { false, false };
+        const string intrinsicsFiles[2] = { "left_camera.yml", "right_camera.yml" };
+        parallel_for_(Range(0, 2), [&](const Range& range) {
+            for (int cam = range.start; cam < range.end; cam++)
+                ok[cam] = calibrateSingleCamera(detections, cam, imageSize, boardSizeInnerCorners, squareSize,
+                    intrinsicsFiles[cam], cameraMatrix[cam], distCoeffs[cam]);
+        });
+        if (!ok[0] || !ok[1])
             return;
-        }
-        fs["camera_matrix"] >> cameraMatrix[0];
-        fs["distortion_coefficients"] >> distCoeffs[0];
-        fs.release();
-        cout << "Ѽڲ: " << leftIntrinsicsFile << endl;
     }
-
-    // ڲ
-    string rightIntrinsicsFile = "right_camera.yml";
+    else
     {
-        FileStorage fs(rightIntrinsicsFile, FileStorage::READ);
-        if (!fs.isOpened()) {
-            cerr << ": ޷ڲļ " << rightIntrinsicsFile << endl;
-            cerr << "ȷļͬһĿ¼" << endl;
-            return;
+        // ڲ
+        string leftIntrinsicsFile = "left_camera.yml";
+        {
+            FileStorage fs(leftIntrinsicsFile, FileStorage::READ);
+            if (!fs.isOpened()) {
+                cerr << ": ޷ڲļ " << leftIntrinsicsFile << endl;
+                cerr << "ȷļͬһĿ¼" << endl;
+                return;
+            }
+            fs["camera_matrix"] >> cameraMatrix[0];
+            fs["distortion_coefficients"] >> distCoeffs[0];
+            fs.release();
+            cout << "Ѽڲ: " << leftIntrinsicsFile << endl;
+        }
+
+        // ڲ
+        string rightIntrinsicsFile = "right_camera.yml";
+        {
+            FileStorage fs(rightIntrinsicsFile, FileStorage::READ);
+            if (!fs.isOpened()) {
+                cerr << ": ޷ڲļ " << rightIntrinsicsFile << endl;
+                cerr << "ȷļͬһĿ¼" << endl;
+                return;
+            }
+            fs["camera_matrix"] >> cameraMatrix[1];
+            fs["distortion_coefficients"] >> distCoeffs[1];
+            fs.release();
+            cout << "Ѽڲ: " << rightIntrinsicsFile << endl;
         }
-        fs["camera_matrix"] >> cameraMatrix[1];
-        fs["distortion_coefficients"] >> distCoeffs[1];
-        fs.release();
-        cout << "Ѽڲ: " << rightIntrinsicsFile << endl;
     }
 
     // ʾصڲΣѡ
@@ -275,46 +544,72 @@ StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, f
 
     cout << "Running stereo calibration ...\n";
 
-    Mat R, T, E, F;
+    Mat R, T, E, F, perViewErrors;
 
     // ޸ģʹù̶ڲģʽ
     double rms = stereoCalibrate(objectPoints, imagePoints[0], imagePoints[1],
         cameraMatrix[0], distCoeffs[0],
         cameraMatrix[1], distCoeffs[1],
-        imageSize, R, T, E, F,
+        imageSize, R, T, E, F, perViewErrors,
         CALIB_FIX_INTRINSIC,  // ̶ڲ
         TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 100, 1e-5));
     cout << "done with RMS error=" << rms << endl;
 
+    // Outlier rejection: a pair's error is the worse of its two views. Pairs
+    // above the robust threshold are dropped and the solve is restarted from
+    // the current R and T, so each pass only needs a few iterations.
+    for (int iter = 0; opts.rejectK > 0 && iter < 5; iter++)
+    {
+        vector<double> pairErr(nimages);
+        for (i = 0; i < nimages; i++)
+            pairErr[i] = max(perViewErrors.at<double>(i, 0), perViewErrors.at<double>(i, 1));
+        double threshold = robustErrorThreshold(pairErr, opts.rejectK);
+        int nkeep = (int)count_if(pairErr.begin(), pairErr.end(), [&](double e) { return e <= threshold; });
+        if (nkeep == nimages || nkeep < 4)
+            break;
+
+        for (i = j = 0; i < nimages; i++)
+        {
+            if (pairErr[i] > threshold)
+            {
+                cout << "Rejecting pair " << goodImageList[i * 2] << " " << goodImageList[i * 2 + 1]
+                    << " (error " << pairErr[i] << " > " << threshold << ")" << endl;
+                continue;
+            }
+            if (j != i)
+            {
+                objectPoints[j] = objectPoints[i];
+                imagePoints[0][j] = imagePoints[0][i];
+                imagePoints[1][j] = imagePoints[1][i];
+                goodImageList[j * 2] = goodImageList[i * 2];
+                goodImageList[j * 2 + 1] = goodImageList[i * 2 + 1];
+            }
+            j++;
+        }
+        nimages = j;
+        objectPoints.resize(nimages);
+        imagePoints[0].resize(nimages);
+        imagePoints[1].resize(nimages);
+        goodImageList.resize(nimages * 2);
+
+        rms = stereoCalibrate(objectPoints, imagePoints[0], imagePoints[1],
+            cameraMatrix[0], distCoeffs[0],
+            cameraMatrix[1], distCoeffs[1],
+            imageSize, R, T, E, F, perViewErrors,
+            CALIB_FIX_INTRINSIC | CALIB_USE_EXTRINSIC_GUESS,
+            TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 100, 1e-5));
+        cout << "RMS error after rejection pass " << iter + 1 << " (" << nimages << " pairs) = " << rms << endl;
+    }
+
     // CALIBRATION QUALITY CHECK
     // because the output fundamental matrix implicitly
     // includes all the output information,
     // we can check the quality of calibration using the
     // epipolar geometry constraint: m2^t*F*m1=0
-    double err = 0;
-    int npoints = 0;
-    vector<Vec3f> lines[2];
-    for (i = 0; i < nimages; i++)
-    {
-        int npt = (int)imagePoints[0][i].size();
-        Mat imgpt[2];
-        for (k = 0; k < 2; k++)
-        {
-            imgpt[k] = Mat(imagePoints[k][i]);
-            undistortPoints(imgpt[k], imgpt[k], cameraMatrix[k], distCoeffs[k], Mat(), cameraMatrix[k]);
-            computeCorrespondEpilines(imgpt[k], k + 1, F, lines[k]);
-        }
-        for (j = 0; j < npt; j++)
-        {
-            double errij = fabs(imagePoints[0][i][j].x * lines[1][j][0] +
-                imagePoints[0][i][j].y * lines[1][j][1] + lines[1][j][2]) +
-                fabs(imagePoints[1][i][j].x * lines[0][j][0] +
-                    imagePoints[1][i][j].y * lines[0][j][1] + lines[0][j][2]);
-            err += errij;
-        }
-        npoints += npt;
-    }
-    cout << "average epipolar err = " << err / npoints << endl;
+    vector<double> epipolarErrors;
+    double avgEpipolarErr = computeEpipolarErrors(imagePoints, cameraMatrix, distCoeffs, F, epipolarErrors);
+    cout << "average epipolar err = " << avgEpipolarErr << endl;
+    reportViewErrors(opts.reportFile, goodImageList, epipolarErrors, perViewErrors, rms, avgEpipolarErr);
 
     // ע⣺Ƴ˱ڲεĴ룬ΪѾǰintrinsics.yml
 
@@ -338,17 +633,34 @@ StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, f
     else
         cout << "Error: can not save the extrinsic parameters\n";
 
+    // The bundle carries the rectification DoubleMatch computes (default
+    // alpha rather than the alpha=1 used above) together with its maps, so
+    // consumers can memory-map it instead of re-parsing the yml files.
+    if (!opts.bundleFile.empty())
+    {
+        CalibBundle bundle;
+        bundle.M1 = cameraMatrix[0];
+        bundle.D1 = distCoeffs[0];
+        bundle.M2 = cameraMatrix[1];
+        bundle.D2 = distCoeffs[1];
+        bundle.R = R;
+        bundle.T = T;
+        bundle.rectify(imageSize);
+        if (bundle.save(opts.bundleFile))
+            cout << "Saved calibration bundle to " << opts.bundleFile << endl;
+    }
+
     // OpenCV can handle left-right
     // or up-down camera arrangements
     bool isVerticalStereo = fabs(P2.at<double>(1, 3)) > fabs(P2.at<double>(0, 3));
 
     // COMPUTE AND DISPLAY RECTIFICATION
-    if (!showRectified)
+    if (!opts.showRectified || !preview.active())
         return;
 
     Mat rmap[2][2];
     // IF BY CALIBRATED (BOUGUET'S METHOD)
-    if (useCalibrated)
+    if (opts.useCalibrated)
     {
         // we already computed everything
     }
@@ -405,7 +717,7 @@ StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, f
             cvtColor(rimg, cimg, COLOR_GRAY2BGR);
             Mat canvasPart = !isVerticalStereo ? canvas(Rect(w * k, 0, w, h)) : canvas(Rect(0, h * k, w, h));
             resize(cimg, canvasPart, canvasPart.size(), 0, 0, INTER_AREA);
-            if (useCalibrated)
+            if (opts.useCalibrated)
             {
                 Rect vroi(cvRound(validRoi[k].x * sf), cvRound(validRoi[k].y * sf),
                     cvRound(validRoi[k].width * sf), cvRound(validRoi[k].height * sf));
@@ -419,8 +731,7 @@ StereoCalib(const vector<string>& imagelist, Size inputBoardSize, string type, f
         else
             for (j = 0; j < canvas.cols; j += 16)
                 line(canvas, Point(j, 0), Point(j, canvas.rows), Scalar(0, 255, 0), 1, 8);
-        imshow("rectified", canvas);
-        char c = (char)waitKey();
+        char c = (char)preview.show("rectified", canvas, 0);
         if (c == 27 || c == 'q' || c == 'Q')
             break;
     }
@@ -446,11 +757,11 @@ int main1(int argc, char** argv)
 {
     Size inputBoardSize;
     string imagelistfn;
-    bool showRectified;
-    cv::CommandLineParser parser(argc, argv, "{w|9|}{h|6|}{t|chessboard|}{s|1.0|}{ms|0.5|}{ad|DICT_4X4_50|}{adf|None|}{nr||}{help||}{@input|stereo_calib.xml|}");
+    cv::CommandLineParser parser(argc, argv, "{w|9|}{h|6|}{t|chessboard|}{s|1.0|}{ms|0.5|}{ad|DICT_4X4_50|}{adf|None|}{cache||}{pyr||}{report||}{reject|0|}{headless||}{preview-dir||}{joint||}{bundle|calib_bundle.bin|}{nr||}{help||}{@input|stereo_calib.xml|}");
     if (parser.has("help"))
         return print_help(argv);
-    showRectified = !parser.has("nr");
+    StereoCalibOptions opts;
+    opts.showRectified = !parser.has("nr");
     imagelistfn = samples::findFile(parser.get<string>("@input"));
     inputBoardSize.width = parser.get<int>("w");
     inputBoardSize.height = parser.get<int>("h");
@@ -459,6 +770,15 @@ int main1(int argc, char** argv)
     float markerSize = parser.get<float>("ms");
     string arucoDictName = parser.get<string>("ad");
     string arucoDictFile = parser.get<string>("adf");
+    opts.cacheFile = parser.get<string>("cache");
+    opts.pyramidFirst = parser.has("pyr");
+    opts.reportFile = parser.get<string>("report");
+    opts.rejectK = parser.get<double>("reject");
+    opts.previewDir = parser.get<string>("preview-dir");
+    opts.calibrateIntrinsics = parser.has("joint");
+    opts.bundleFile = parser.get<string>("bundle");
+    opts.previewMode = !opts.previewDir.empty() ? PreviewSink::DISK :
+        parser.has("headless") ? PreviewSink::NONE : PreviewSink::WINDOW;
 
     cv::aruco::PredefinedDictionaryType arucoDict;
     if (arucoDictName == "DICT_4X4_50") { arucoDict = cv::aruco::DICT_4X4_50; }
@@ -500,6 +820,6 @@ int main1(int argc, char** argv)
         return print_help(argv);
     }
 
-    StereoCalib(imagelist, inputBoardSize, type, squareSize, markerSize, arucoDict, arucoDictFile, false, true, showRectified);
+    StereoCalib(imagelist, inputBoardSize, type, squareSize, markerSize, arucoDict, arucoDictFile, opts);
     return 0;
 }
\ No newline at end of file
@@ -10,12 +10,24 @@
 #include "opencv2/imgcodecs.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/core/utility.hpp"
+#include "CalibBundle.h"
+#include "GridMesh.h"
+#include "PlaneFit.h"
+#include "PointCloud.h"
+#include "PointCloudSink.h"
+#include "PointOctree.h"
 
 #include <stdio.h>
+#include <limits.h>
 #include <sstream>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <filesystem>
+#include <functional>
 
 using namespace cv;
 using namespace std;
@@ -25,46 +37,698 @@ static void print_help(char** argv)
     printf("\nDemo stereo matching converting L and R images into disparity and point clouds\n");
     printf("\nUsage: %s <left_image> <right_image> [--algorithm=bm|sgbm|hh|hh4|sgbm3way] [--blocksize=<block_size>]\n"
         "[--max-disparity=<max_disparity>] [--scale=scale_factor>] [-i=<intrinsic_filename>] [-e=<extrinsic_filename>]\n"
-        "[--no-display] [--color] [-o=<disparity_image>] [-p=<point_cloud_file>]\n", argv[0]);
+        "[--no-display] [--color] [-o=<disparity_image>] [-p=<point_cloud_file>]\n"
+        "[--report=<timing_report.json|.csv>] [--dump-dir=<debug_dump_directory>]\n"
+        "[--postfilter] [--speckle-size=<pixels>] [--speckle-range=<disparity>] [--lr-check] [--lr-tol=<disparity>]\n"
+        "[--hole-fill=<max_hole_width>] [--sequence] [--seq-band=<rows>] [--seq-margin=<disparity>] [--gray]\n"
+        "[--bundle=<calib_bundle.bin>] (use instead of -i/-e) [--voxel=<voxel_size>]\n"
+        "[--fuse=<fused_cloud.xyz>] [--poses=<pair_poses.txt>] [--organized=<organized_cloud>]\n"
+        "[--mesh=<mesh_file_prefix>] [--mesh-format=ply|stl] [--mesh-tol=<flatness_tolerance>]\n"
+        "[--outlier] [--outlier-window=<pixels>] [--outlier-k=<sigmas>]\n"
+        "[--octree=<octree_directory>] [--plane=<deviation_prefix>] [--planes=<max_planes>]\n"
+        "[--plane-tol=<inlier_distance>] [--deviation-range=<color_range>]\n"
+        "[--depth=<depth_prefix>] [--depth-format=png|tiff] [--depth-scale=<factor_to_mm>]\n"
+        "[--cloud-format=xyz|ply]\n", argv[0]);
 }
 
-static void saveColoredXYZ(const char* filename, const Mat& mat, const Mat& color_img)
+enum Stage { STAGE_LOAD, STAGE_RECTIFY, STAGE_MATCH, STAGE_POSTFILTER, STAGE_COLORMAP, STAGE_REPROJECT, STAGE_DOWNSAMPLE, STAGE_OUTLIER, STAGE_FUSE, STAGE_MESH, STAGE_PLANE, STAGE_WRITE, STAGE_COUNT };
+static const char* const stage_names[STAGE_COUNT] = { "load", "rectify", "match", "postfilter", "colormap", "reproject", "downsample", "outlier", "fuse", "mesh", "plane", "write" };
+
+struct PairTiming
+{
+    int pair_idx = 0;
+    string left, right;
+    double ms[STAGE_COUNT] = {};
+
+    double total() const
+    {
+        double sum = 0;
+        for (int s = 0; s < STAGE_COUNT; s++)
+            sum += ms[s];
+        return sum;
+    }
+};
+
+// Adds the lifetime of the object to one stage of a pair's timing.
+class StageTimer
+{
+public:
+    StageTimer(PairTiming& timing, Stage stage) : timing_(timing), stage_(stage), start_(getTickCount()) {}
+    ~StageTimer() { timing_.ms[stage_] += (getTickCount() - start_) * 1000. / getTickFrequency(); }
+
+private:
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    PairTiming& timing_;
+    Stage stage_;
+    int64 start_;
+};
+
+static void printPairTiming(const PairTiming& timing)
+{
+    cout << "Timing (ms):";
+    for (int s = 0; s < STAGE_COUNT; s++)
+        cout << " " << stage_names[s] << "=" << timing.ms[s];
+    cout << " total=" << timing.total() << endl;
+}
+
+static string jsonEscape(const string& str)
 {
-    const double max_z = 1.0e4;
-    FILE* fp = fopen(filename, "wt");
-    if (!fp) {
+    string out;
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+// Writes per-pair stage timings plus batch sums and means. The format is
+// chosen by extension: ".csv" gives one row per pair followed by "sum" and
+// "mean" rows, anything else is written as JSON.
+static bool writeTimingReport(const string& filename, const vector<PairTiming>& timings)
+{
+    ofstream out(filename);
+    if (!out.is_open()) {
         cerr << "Failed to open " << filename << " for writing" << endl;
-        return;
+        return false;
     }
 
-    // Convert color image to RGB format if grayscale
-    Mat color_rgb;
-    if (color_img.channels() == 1) {
-        cvtColor(color_img, color_rgb, COLOR_GRAY2RGB);
+    PairTiming sum, mean;
+    for (const PairTiming& t : timings)
+        for (int s = 0; s < STAGE_COUNT; s++)
+            sum.ms[s] += t.ms[s];
+    for (int s = 0; s < STAGE_COUNT; s++)
+        mean.ms[s] = timings.empty() ? 0 : sum.ms[s] / timings.size();
+
+    bool csv = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".csv") == 0;
+    if (csv) {
+        out << "pair,left,right";
+        for (int s = 0; s < STAGE_COUNT; s++)
+            out << "," << stage_names[s] << "_ms";
+        out << ",total_ms\n";
+        for (const PairTiming& t : timings) {
+            out << t.pair_idx << "," << t.left << "," << t.right;
+            for (int s = 0; s < STAGE_COUNT; s++)
+                out << "," << t.ms[s];
+            out << "," << t.total() << "\n";
+        }
+        const PairTiming* rows[2] = { &sum, &mean };
+        const char* labels[2] = { "sum", "mean" };
+        for (int r = 0; r < 2; r++) {
+            out << labels[r] << ",,";
+            for (int s = 0; s < STAGE_COUNT; s++)
+                out << "," << rows[r]->ms[s];
+            out << "," << rows[r]->total() << "\n";
+        }
     }
     else {
-        color_rgb = color_img.clone();
+        auto writeStages = [&](const PairTiming& t) {
+            for (int s = 0; s < STAGE_COUNT; s++)
+                out << "\"" << stage_names[s] << "_ms\": " << t.ms[s] << ", ";
+            out << "\"total_ms\": " << t.total();
+        };
+        out << "{\n  \"pairs\": [";
+        for (size_t i = 0; i < timings.size(); i++) {
+            const PairTiming& t = timings[i];
+            out << (i ? ",\n" : "\n") << "    { \"pair\": " << t.pair_idx
+                << ", \"left\": \"" << jsonEscape(t.left) << "\", \"right\": \"" << jsonEscape(t.right) << "\", ";
+            writeStages(t);
+            out << " }";
+        }
+        out << "\n  ],\n  \"batch\": { \"pairs\": " << timings.size() << ",\n    \"sum\": { ";
+        writeStages(sum);
+        out << " },\n    \"mean\": { ";
+        writeStages(mean);
+        out << " } }\n}\n";
+    }
+    cout << "Saved timing report to " << filename << endl;
+    return true;
+}
+
+// Points this far from the camera (calibration units) come from disparities
+// next to zero and are dropped from every cloud and depth map.
+static const float max_point_z = 1.0e4f;
+
+// Reprojects disparity through Q with DisparityReprojector straight into
+// colored points; pixels without a point are dropped. Rows are processed
+// in parallel chunks and the chunks are concatenated in row order, so the
+// output matches a plain row-major scan. With a sink, each chunk is handed to
+// it as soon as it is done instead and points stays empty. Returns the number
+// of chunks.
+static int reprojectColoredPoints(const Mat& disp, const Mat& Q, const Mat& color,
+    int min_disparity, float max_z, vector<ColoredPoint>& points, PointCloudSink* sink = nullptr)
+{
+    CV_Assert(disp.type() == CV_16SC1);
+    CV_Assert(color.size() == disp.size() && (color.type() == CV_8UC3 || color.type() == CV_8UC1));
+
+    const DisparityReprojector reprojector(Q, min_disparity, max_z);
+    const int chunk_rows = 16;
+    const int nchunks = (disp.rows + chunk_rows - 1) / chunk_rows;
+    vector<vector<ColoredPoint> > chunks(nchunks);
+
+    parallel_for_(Range(0, nchunks), [&](const Range& range) {
+        DisparityReprojector row = reprojector;
+        for (int c = range.start; c < range.end; c++) {
+            vector<ColoredPoint>& out = chunks[c];
+            out.reserve((size_t)chunk_rows * disp.cols);
+            int y_end = std::min(disp.rows, (c + 1) * chunk_rows);
+            for (int y = c * chunk_rows; y < y_end; y++) {
+                const short* drow = disp.ptr<short>(y);
+                const uchar* crow = color.ptr<uchar>(y);
+                const int cn = color.channels();
+                row.setRow(y);
+                for (int x = 0; x < disp.cols; x++) {
+                    Vec3f xyz;
+                    if (!row.reproject(x, drow[x], xyz))
+                        continue;
+                    ColoredPoint p;
+                    p.x = xyz[0];
+                    p.y = xyz[1];
+                    p.z = xyz[2];
+                    const uchar* px = crow + x * cn;
+                    if (cn == 3) {
+                        p.r = px[2]; p.g = px[1]; p.b = px[0]; // OpenCV is BGR order, convert to RGB
+                    }
+                    else {
+                        p.r = p.g = p.b = px[0];
+                    }
+                    out.push_back(p);
+                }
+            }
+            if (sink)
+                sink->write(c, std::move(out));
+        }
+    });
+
+    points.clear();
+    if (sink)
+        return nchunks;
+    size_t total = 0;
+    for (const auto& chunk : chunks)
+        total += chunk.size();
+    points.reserve(total);
+    for (const auto& chunk : chunks)
+        points.insert(points.end(), chunk.begin(), chunk.end());
+    return nchunks;
+}
+
+// ====================== Disparity post-filtering ======================
+
+struct PostFilterParams
+{
+    int speckle_size = 100;    // regions smaller than this many pixels are removed
+    int speckle_range = 32;    // max disparity step (pixels) inside one region
+    int lr_tolerance = 1;      // max left/right disagreement (pixels); < 0 disables the check
+    int max_hole_width = 32;   // widest horizontal hole that gets filled; 0 disables filling
+    int guide_tolerance = 12;  // intensity difference treated as "same surface" when filling
+};
+
+static inline int findRoot(int* parent, int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Roots are always the smallest index of their set, so parent[i] <= i holds
+// for every pixel. The flattening pass in filterSpecklesUnionFind relies on it.
+static inline void unite(int* parent, int a, int b)
+{
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+// Same result as cv::filterSpeckles, but linear-time and parallel: horizontal
+// bands are labelled independently with union-find, the band seams are joined
+// afterwards and every region of at most max_size pixels is set to new_val.
+static void filterSpecklesUnionFind(Mat& disp, short new_val, int max_size, int max_diff)
+{
+    CV_Assert(disp.type() == CV_16SC1);
+    const int rows = disp.rows, cols = disp.cols, n = rows * cols;
+    if (n == 0 || max_size <= 0)
+        return;
+
+    vector<int> parent_buf(n);
+    int* parent = parent_buf.data();
+    auto connected = [&](short a, short b) {
+        return a > new_val && b > new_val && std::abs(a - b) <= max_diff;
+    };
+
+    const int band_rows = 32;
+    const int nbands = (rows + band_rows - 1) / band_rows;
+    parallel_for_(Range(0, nbands), [&](const Range& range) {
+        for (int b = range.start; b < range.end; b++) {
+            int y0 = b * band_rows, y1 = std::min(rows, y0 + band_rows);
+            for (int y = y0; y < y1; y++) {
+                const short* row = disp.ptr<short>(y);
+                const short* up = y > y0 ? disp.ptr<short>(y - 1) : 0;
+                for (int x = 0; x < cols; x++) {
+                    int i = y * cols + x;
+                    parent[i] = i;
+                    if (x > 0 && connected(row[x], row[x - 1]))
+                        unite(parent, i, i - 1);
+                    if (up && connected(row[x], up[x]))
+                        unite(parent, i, i - cols);
+                }
+            }
+        }
+    });
+
+    for (int b = 1; b < nbands; b++) {
+        int y = b * band_rows;
+        const short* row = disp.ptr<short>(y);
+        const short* up = disp.ptr<short>(y - 1);
+        for (int x = 0; x < cols; x++)
+            if (connected(row[x], up[x]))
+                unite(parent, y * cols + x, (y - 1) * cols + x);
+    }
+
+    // parent[i] <= i, so one forward pass turns every entry into its root.
+    vector<int> region_size(n, 0);
+    for (int i = 0; i < n; i++) {
+        parent[i] = parent[parent[i]];
+        region_size[parent[i]]++;
+    }
+
+    parallel_for_(Range(0, rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            short* row = disp.ptr<short>(y);
+            const int* prow = parent + y * cols;
+            for (int x = 0; x < cols; x++)
+                if (row[x] > new_val && region_size[prow[x]] <= max_size)
+                    row[x] = new_val;
+        }
+    });
+}
+
+// Computes the disparity of a left/right pair, the way the frame itself was
+// matched (full frame or in sequence bands).
+typedef std::function<void(const Mat& left, const Mat& right, Mat& disp)> PairMatcher;
+
+// Matches the flipped pair to get disparity in right-image coordinates. The
+// flip keeps rows and disparity values, so the left view's bands apply.
+static void computeRightDisparity(const PairMatcher& match, const Mat& left, const Mat& right, Mat& disp_right)
+{
+    Mat left_flipped, right_flipped, disp_flipped;
+    flip(left, left_flipped, 1);
+    flip(right, right_flipped, 1);
+    match(right_flipped, left_flipped, disp_flipped);
+    flip(disp_flipped, disp_right, 1);
+}
+
+// Invalidates left disparities whose right-image match does not point back
+// within tolerance. For the pixels that pass, confidence falls linearly from
+// 255 at perfect agreement to 128 at the tolerance; it is 0 for invalidated
+// pixels and wherever either side is invalid.
+static void checkLeftRightConsistency(Mat& disp, const Mat& disp_right, short new_val, int tolerance, Mat& confidence)
+{
+    CV_Assert(disp.type() == CV_16SC1 && disp_right.type() == CV_16SC1 && disp.size() == disp_right.size());
+    confidence.create(disp.size(), CV_8UC1);
+    const int tol16 = tolerance * 16;
+    const float conf_scale = 255.f / (2 * std::max(tol16, 1));
+
+    parallel_for_(Range(0, disp.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            short* dl = disp.ptr<short>(y);
+            const short* dr = disp_right.ptr<short>(y);
+            uchar* conf = confidence.ptr<uchar>(y);
+            for (int x = 0; x < disp.cols; x++) {
+                conf[x] = 0;
+                if (dl[x] <= new_val)
+                    continue;
+                int xr = x - ((dl[x] + 8) >> 4);
+                int diff = xr >= 0 && dr[xr] > new_val ? std::abs(dl[x] - dr[xr]) : INT_MAX;
+                if (diff > tol16) {
+                    dl[x] = new_val;
+                    continue;
+                }
+                conf[x] = saturate_cast<uchar>(255.f - diff * conf_scale);
+            }
+        }
+    });
+}
+
+// Fills horizontal runs of invalid disparity bounded by valid pixels on both
+// sides. Each pixel takes the neighbour whose guide intensity is closer, so
+// fills stop at image edges; when neither side looks like the same surface the
+// farther (smaller) disparity wins, which is the usual occlusion case.
+static void fillHolesEdgeAware(Mat& disp, const Mat& guide, short new_val, int max_width, int guide_tolerance)
+{
+    CV_Assert(disp.type() == CV_16SC1 && guide.type() == CV_8UC1 && guide.size() == disp.size());
+
+    parallel_for_(Range(0, disp.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            short* d = disp.ptr<short>(y);
+            const uchar* g = guide.ptr<uchar>(y);
+            int x = 0;
+            while (x < disp.cols) {
+                if (d[x] > new_val) {
+                    x++;
+                    continue;
+                }
+                int start = x;
+                while (x < disp.cols && d[x] <= new_val)
+                    x++;
+                if (start == 0 || x == disp.cols || x - start > max_width)
+                    continue;
+                int l = start - 1, r = x;
+                for (int k = start; k < r; k++) {
+                    int gl = std::abs(g[k] - g[l]), gr = std::abs(g[k] - g[r]);
+                    if (gl > guide_tolerance && gr > guide_tolerance)
+                        d[k] = std::min(d[l], d[r]);
+                    else
+                        d[k] = gl <= gr ? d[l] : d[r];
+                }
+            }
+        }
+    });
+}
+
+// Replaces the matcher's built-in speckle filter: optional left/right check,
+// union-find speckle removal, then edge-aware hole filling. The right view of
+// the left/right check is matched with match, so it gets the same narrowed
+// search ranges as the left one.
+static void postFilterDisparity(Mat& disp, const Ptr<StereoMatcher>& matcher, const PairMatcher& match,
+    const Mat& left, const Mat& right, const PostFilterParams& params, Mat& confidence)
+{
+    const short new_val = (short)((matcher->getMinDisparity() - 1) * 16);
+
+    if (params.lr_tolerance >= 0) {
+        Mat disp_right;
+        computeRightDisparity(match, left, right, disp_right);
+        checkLeftRightConsistency(disp, disp_right, new_val, params.lr_tolerance, confidence);
+    }
+
+    filterSpecklesUnionFind(disp, new_val, params.speckle_size, params.speckle_range * 16);
+
+    if (params.max_hole_width > 0) {
+        Mat guide;
+        if (left.channels() == 3)
+            cvtColor(left, guide, COLOR_BGR2GRAY);
+        else
+            guide = left;
+        fillHolesEdgeAware(disp, guide, new_val, params.max_hole_width, params.guide_tolerance);
+    }
+}
+
+// ====================== Sequence-aware matching ======================
+
+struct SearchBand
+{
+    int y0, y1;
+    int min_disparity, num_disparities;
+    bool narrowed;
+    double prior_valid;         // fraction of valid pixels in the prior band
+};
+
+// Splits the image into horizontal bands and derives each band's disparity
+// search range from the previous pair's disparity: the 1st..99th percentile of
+// the valid prior values, widened by margin and snapped to multiples of 16.
+// Bands with too few valid prior pixels keep the full range.
+static vector<SearchBand> planSearchBands(const Mat& prior, int band_rows, int full_min, int full_num,
+    int margin, double min_valid_fraction)
+{
+    vector<SearchBand> bands;
+    const int full_max = full_min + full_num;
+    for (int y0 = 0; y0 < prior.rows; y0 += band_rows) {
+        SearchBand band = { y0, std::min(prior.rows, y0 + band_rows), full_min, full_num, false, 0 };
+
+        vector<int> hist(full_num, 0);
+        int valid = 0;
+        for (int y = band.y0; y < band.y1; y++) {
+            const short* row = prior.ptr<short>(y);
+            for (int x = 0; x < prior.cols; x++) {
+                int d = row[x] >> 4;
+                if (row[x] < full_min * 16 || d >= full_max)
+                    continue;
+                hist[d - full_min]++;
+                valid++;
+            }
+        }
+
+        band.prior_valid = (double)valid / ((band.y1 - band.y0) * prior.cols);
+        if (band.prior_valid >= min_valid_fraction) {
+            int lo = 0, hi = full_num - 1, acc = 0;
+            for (; lo < full_num && (acc += hist[lo]) < valid / 100; lo++)
+                ;
+            for (acc = 0; hi > 0 && (acc += hist[hi]) < valid / 100; hi--)
+                ;
+            int dmin = std::max(full_min, (full_min + lo - margin) & -16);
+            int dmax = std::min(full_max, ((full_min + hi + margin) + 15) & -16);
+            if (dmax - dmin < full_num && dmax > dmin) {
+                band.min_disparity = dmin;
+                band.num_disparities = dmax - dmin;
+                band.narrowed = true;
+            }
+        }
+        bands.push_back(band);
+    }
+    return bands;
+}
+
+// Creates an independent matcher with the same settings, so bands with
+// different search ranges can be matched concurrently.
+static Ptr<StereoMatcher> cloneMatcher(const Ptr<StereoMatcher>& matcher)
+{
+    if (Ptr<StereoSGBM> sgbm = matcher.dynamicCast<StereoSGBM>())
+        return StereoSGBM::create(sgbm->getMinDisparity(), sgbm->getNumDisparities(), sgbm->getBlockSize(),
+            sgbm->getP1(), sgbm->getP2(), sgbm->getDisp12MaxDiff(), sgbm->getPreFilterCap(),
+            sgbm->getUniquenessRatio(), sgbm->getSpeckleWindowSize(), sgbm->getSpeckleRange(), sgbm->getMode());
+
+    Ptr<StereoBM> bm = matcher.dynamicCast<StereoBM>();
+    CV_Assert(bm);
+    Ptr<StereoBM> copy = StereoBM::create(bm->getNumDisparities(), bm->getBlockSize());
+    copy->setMinDisparity(bm->getMinDisparity());
+    copy->setPreFilterType(bm->getPreFilterType());
+    copy->setPreFilterSize(bm->getPreFilterSize());
+    copy->setPreFilterCap(bm->getPreFilterCap());
+    copy->setTextureThreshold(bm->getTextureThreshold());
+    copy->setUniquenessRatio(bm->getUniquenessRatio());
+    copy->setSpeckleWindowSize(bm->getSpeckleWindowSize());
+    copy->setSpeckleRange(bm->getSpeckleRange());
+    copy->setDisp12MaxDiff(bm->getDisp12MaxDiff());
+    return copy;
+}
+
+// Matches the rows [y0, y1) with the given search range plus `context` extra
+// rows above and below, and copies the result into disp with the frame's
+// invalid marker. Returns the fraction of pixels that are invalid or lie on
+// the first or last disparity of the range.
+static double matchBand(const Ptr<StereoMatcher>& matcher, const Mat& left, const Mat& right,
+    int y0, int y1, int min_disparity, int num_disparities, int context, Mat& disp)
+{
+    int ey0 = std::max(0, y0 - context), ey1 = std::min(left.rows, y1 + context);
+    Rect roi(0, ey0, left.cols, ey1 - ey0);
+
+    Ptr<StereoMatcher> band_matcher = cloneMatcher(matcher);
+    band_matcher->setMinDisparity(min_disparity);
+    band_matcher->setNumDisparities(num_disparities);
+    Mat band_disp;
+    band_matcher->compute(left(roi), right(roi), band_disp);
+
+    // Keep one invalid marker for the whole frame regardless of the band's range.
+    Mat src = band_disp.rowRange(y0 - ey0, y1 - ey0), dst = disp.rowRange(y0, y1);
+    const short invalid = (short)((matcher->getMinDisparity() - 1) * 16);
+    const short band_invalid = (short)((min_disparity - 1) * 16);
+    const int edge_lo = (min_disparity + 1) * 16, edge_hi = (min_disparity + num_disparities - 2) * 16;
+    int suspect = 0;
+    for (int y = 0; y < src.rows; y++) {
+        const short* s = src.ptr<short>(y);
+        short* d = dst.ptr<short>(y);
+        for (int x = 0; x < src.cols; x++) {
+            d[x] = s[x] <= band_invalid ? invalid : s[x];
+            suspect += s[x] <= band_invalid || s[x] < edge_lo || s[x] > edge_hi;
+        }
     }
+    return (double)suspect / src.total();
+}
+
+// Matches every narrowed band with its own search range; runs of contiguous
+// bands that keep the full range are matched as one segment, so a frame with
+// nothing narrowed is matched exactly like a full-frame run. Each segment is
+// matched with `context` extra rows above and below, which gives StereoBM the
+// same block neighbourhood as a full-frame run; SGBM's vertical and diagonal
+// paths are still cut at the extended segment edges, so its result near the
+// borders of narrowed bands can differ slightly from a full-frame run.
+//
+// A narrowed band is re-matched with the full range when the current pair does
+// not fit it: when the fraction of invalid or range-edge pixels exceeds the
+// prior's invalid fraction by more than max_extra_suspect, the surface has
+// most likely moved outside the predicted range. Returns the number of such
+// fallbacks.
+static int computeBanded(const Ptr<StereoMatcher>& matcher, const Mat& left, const Mat& right,
+    const vector<SearchBand>& bands, int context, double max_extra_suspect, Mat& disp)
+{
+    vector<SearchBand> segments;
+    for (const SearchBand& band : bands) {
+        if (!band.narrowed && !segments.empty() && !segments.back().narrowed)
+            segments.back().y1 = band.y1;
+        else
+            segments.push_back(band);
+    }
+
+    disp.create(left.size(), CV_16SC1);
+    std::atomic<int> fallbacks(0);
+    parallel_for_(Range(0, (int)segments.size()), [&](const Range& range) {
+        for (int b = range.start; b < range.end; b++) {
+            const SearchBand& band = segments[b];
+            double suspect = matchBand(matcher, left, right, band.y0, band.y1, band.min_disparity,
+                band.num_disparities, context, disp);
+            if (band.narrowed && suspect > 1.0 - band.prior_valid + max_extra_suspect) {
+                matchBand(matcher, left, right, band.y0, band.y1, matcher->getMinDisparity(),
+                    matcher->getNumDisparities(), context, disp);
+                fallbacks++;
+            }
+        }
+    });
+    return fallbacks;
+}
+
+// ====================== Rectification ======================
+
+struct StereoRectification
+{
+    Size size;
+    Mat map1[2], map2[2];  // fixed-point CV_16SC2 / CV_16UC1 remap tables
+    Mat Q;
+    Rect roi[2];
+};
+
+static void computeRectification(const Mat& M1, const Mat& D1, const Mat& M2, const Mat& D2,
+    const Mat& R, const Mat& T, Size img_size, StereoRectification& rect)
+{
+    Mat R1, P1, R2, P2;
+    stereoRectify(M1, D1, M2, D2, img_size, R, T, R1, R2, P1, P2, rect.Q,
+        CALIB_ZERO_DISPARITY, -1, img_size, &rect.roi[0], &rect.roi[1]);
+    initUndistortRectifyMap(M1, D1, R1, P1, img_size, CV_16SC2, rect.map1[0], rect.map2[0]);
+    initUndistortRectifyMap(M2, D2, R2, P2, img_size, CV_16SC2, rect.map1[1], rect.map2[1]);
+    rect.size = img_size;
+}
+
+// Reads the calibration and builds the rectification maps for one image size.
+// The result is reused for every pair of that size.
+static bool loadRectification(const string& intrinsic_filename, const string& extrinsic_filename,
+    float scale, Size img_size, StereoRectification& rect)
+{
+    FileStorage fs(intrinsic_filename, FileStorage::READ);
+    if (!fs.isOpened()) {
+        cerr << "Failed to open intrinsic file." << endl;
+        return false;
+    }
+    Mat M1, D1, M2, D2;
+    fs["M1"] >> M1; fs["D1"] >> D1;
+    fs["M2"] >> M2; fs["D2"] >> D2;
+    M1 *= scale; M2 *= scale;
+
+    fs.open(extrinsic_filename, FileStorage::READ);
+    if (!fs.isOpened()) {
+        cerr << "Failed to open extrinsic file." << endl;
+        return false;
+    }
+    Mat R, T;
+    fs["R"] >> R; fs["T"] >> T;
+
+    computeRectification(M1, D1, M2, D2, R, T, img_size, rect);
+    return true;
+}
+
+// At the calibrated size the bundle's maps are used as they are (they stay
+// views into the mapped file); other sizes, e.g. with --scale, recompute the
+// rectification from the bundle's calibration.
+static void rectificationFromBundle(const CalibBundle& bundle, float scale, Size img_size,
+    StereoRectification& rect)
+{
+    if (scale == 1.f && img_size == bundle.imageSize && !bundle.map11.empty()) {
+        rect.map1[0] = bundle.map11; rect.map2[0] = bundle.map12;
+        rect.map1[1] = bundle.map21; rect.map2[1] = bundle.map22;
+        rect.Q = bundle.Q;
+        rect.roi[0] = bundle.roi1; rect.roi[1] = bundle.roi2;
+        rect.size = img_size;
+        return;
+    }
+    Mat M1 = bundle.M1 * scale, M2 = bundle.M2 * scale;
+    computeRectification(M1, bundle.D1, M2, bundle.D2, bundle.R, bundle.T, img_size, rect);
+}
 
-    for (int y = 0; y < mat.rows; y++) {
-        for (int x = 0; x < mat.cols; x++) {
-            Vec3f point = mat.at<Vec3f>(y, x);
-            if (fabs(point[2] - max_z) < FLT_EPSILON || fabs(point[2]) > max_z)continue;              
-            Vec3b color = color_rgb.at<Vec3b>(y, x);
-            fprintf(fp, "%f %f %f %d %d %d\n",
-                point[0], point[1], point[2],
-                color[2], color[1], color[0]); // OpenCV is BGR order, convert to RGB
+// Reads per-pair poses for fusion. Each line holds the pair number (1-based,
+// as in the output file names) followed by the 12 values of the row-major 3x4
+// [R|t] that maps the pair's left camera frame into the common frame. Empty
+// lines and lines starting with '#' are skipped.
+static bool loadPairPoses(const string& filename, map<int, Matx34f>& poses)
+{
+    ifstream in(filename);
+    if (!in.is_open()) {
+        cerr << "Failed to open pose file " << filename << endl;
+        return false;
+    }
+    string line;
+    int line_no = 0;
+    while (getline(in, line)) {
+        line_no++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#')
+            continue;
+        istringstream iss(line);
+        int idx;
+        Matx34f pose;
+        iss >> idx;
+        for (int k = 0; k < 12; k++)
+            iss >> pose.val[k];
+        if (!iss) {
+            cerr << "Malformed pose at " << filename << ":" << line_no << endl;
+            return false;
         }
+        poses[idx] = pose;
     }
-    fclose(fp);
-    cout << "Saved colored point cloud to " << filename << endl;
+    return true;
+}
+
+// 64K-entry tables indexed by the raw 16-bit disparity: the 8-bit
+// visualization (scaled and saturated like convertTo) and its turbo colormap.
+static void buildDisparityLut(double scale, Mat& gray_lut, Mat& color_lut)
+{
+    gray_lut.create(1, 65536, CV_8U);
+    uchar* gray = gray_lut.ptr<uchar>();
+    for (int i = 0; i < 65536; i++)
+        gray[i] = saturate_cast<uchar>((short)i * scale);
+    applyColorMap(gray_lut, color_lut, COLORMAP_TURBO);
+}
+
+// One lookup per pixel straight into the output, rows in parallel.
+template <typename T>
+static void applyDisparityLut(const Mat& disp, const Mat& lut, Mat& out)
+{
+    CV_Assert(disp.type() == CV_16SC1 && lut.total() == 65536 && lut.elemSize() == sizeof(T));
+    out.create(disp.size(), lut.type());
+    const T* table = lut.ptr<T>();
+    parallel_for_(Range(0, disp.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const ushort* d = disp.ptr<ushort>(y);
+            T* o = out.ptr<T>(y);
+            for (int x = 0; x < disp.cols; x++)
+                o[x] = table[d[x]];
+        }
+    });
 }
 
 int main2(int argc, char** argv)
 {
     cv::CommandLineParser parser(argc, argv,
         "{help h||}{list||}{algorithm|sgbm|}{max-disparity|64|}{blocksize|5|}"
-        "{no-display||}{color||}{scale|1|}{i||}{e||}{o||}{p||}");
+        "{no-display||}{color||}{scale|1|}{i||}{e||}{o||}{p||}{report||}{dump-dir||}"
+        "{postfilter||}{speckle-size|100|}{speckle-range|32|}{lr-check||}{lr-tol|1|}{hole-fill|32|}"
+        "{sequence||}{seq-band|64|}{seq-margin|16|}{gray||}{bundle||}{voxel|0|}{fuse||}{poses||}{organized||}"
+        "{mesh||}{mesh-format|ply|}{mesh-tol|0.2|}{outlier||}{outlier-window|7|}{outlier-k|3|}{octree||}"
+        "{plane||}{planes|1|}{plane-tol|0.5|}{deviation-range|2|}"
+        "{depth||}{depth-format|png|}{depth-scale|1|}{cloud-format|xyz|}");
 
     if (parser.has("help")) {
         print_help(argv);
@@ -76,19 +740,113 @@ int main2(int argc, char** argv)
     string extrinsic_filename = parser.get<string>("e");
     string disparity_filename = parser.get<string>("o");
     string point_cloud_filename = parser.get<string>("p");
+    // Clouds are written by a background thread; the format of -p is chosen
+    // here, that of --fuse by its extension.
+    string cloud_format = parser.get<string>("cloud-format");
     string algorithm = parser.get<string>("algorithm");
+    string report_filename = parser.get<string>("report");
+    string dump_dir = parser.get<string>("dump-dir");
+    string bundle_filename = parser.get<string>("bundle");
 
     int numberOfDisparities = parser.get<int>("max-disparity");
     int SADWindowSize = parser.get<int>("blocksize");
     float scale = parser.get<float>("scale");
     bool no_display = parser.has("no-display");
     bool color_display = parser.has("color");
+    bool post_filter = parser.has("postfilter");
+    bool match_gray = parser.has("gray");
+    // Voxel edge length in calibration units (mm for our boards); 0 keeps every point.
+    float voxel_size = parser.get<float>("voxel");
+    // Fusion accumulates every pair into one voxel grid (--voxel sized, 1 unit
+    // by default) and writes a single deduplicated cloud at the end.
+    string fuse_filename = parser.get<string>("fuse");
+    string poses_filename = parser.get<string>("poses");
+    // The octree receives every point of every pair (posed like --fuse) and
+    // is built out of core when the last pair is done.
+    string octree_dir = parser.get<string>("octree");
+    // Organized clouds keep the pixel grid and carry normals (binary PCD).
+    string organized_filename = parser.get<string>("organized");
+    // Meshes triangulate the organized grid; flat regions are merged into
+    // larger quads within --mesh-tol (calibration units, 0 = full resolution).
+    string mesh_filename = parser.get<string>("mesh");
+    string mesh_format = parser.get<string>("mesh-format");
+    GridMeshParams mesh_params;
+    mesh_params.flat_tolerance = parser.get<float>("mesh-tol");
+    // Flying pixels at depth edges are removed on the organized grid before
+    // any cloud or mesh is written.
+    bool outlier_filter = parser.has("outlier");
+    GridOutlierParams outlier_params;
+    outlier_params.window = parser.get<int>("outlier-window");
+    outlier_params.k = parser.get<float>("outlier-k");
+    // Plate inspection: planes fitted to the organized cloud, written as
+    // parameters (yml) and a signed deviation image (png) per pair.
+    string plane_filename = parser.get<string>("plane");
+    PlaneFitParams plane_params;
+    plane_params.max_planes = parser.get<int>("planes");
+    plane_params.inlier_threshold = parser.get<float>("plane-tol");
+    float deviation_range = parser.get<float>("deviation-range");
+    // Metric depth so later stages can skip matching: 16-bit millimetres in
+    // a fast-compressed PNG, or float32 in a TIFF.
+    string depth_filename = parser.get<string>("depth");
+    string depth_format = parser.get<string>("depth-format");
+    float depth_scale = parser.get<float>("depth-scale");
+
+    PostFilterParams post_params;
+    post_params.speckle_size = parser.get<int>("speckle-size");
+    post_params.speckle_range = parser.get<int>("speckle-range");
+    post_params.lr_tolerance = parser.has("lr-check") ? parser.get<int>("lr-tol") : -1;
+    post_params.max_hole_width = parser.get<int>("hole-fill");
+
+    // Sequence mode: consecutive pairs overlap, so the previous disparity
+    // bounds the search range of each band in the next pair. The right view
+    // of --lr-check is matched with the same bands.
+    bool sequence_mode = parser.has("sequence");
+    int seq_band_rows = parser.get<int>("seq-band");
+    int seq_margin = parser.get<int>("seq-margin");
+    const int seq_context_rows = 16;
+    const double seq_min_valid_fraction = 0.3;
+    const double seq_max_extra_suspect = 0.15;
 
     if (list_file.empty()) {
         cerr << "Error: Please provide --list=<image_list.txt>" << endl;
         return -1;
     }
 
+    if (mesh_format != "ply" && mesh_format != "stl") {
+        cerr << "Error: --mesh-format must be ply or stl" << endl;
+        return -1;
+    }
+    if (cloud_format != "xyz" && cloud_format != "ply") {
+        cerr << "Error: --cloud-format must be xyz or ply" << endl;
+        return -1;
+    }
+    if (depth_format != "png" && depth_format != "tiff") {
+        cerr << "Error: --depth-format must be png or tiff" << endl;
+        return -1;
+    }
+    if (outlier_params.window < 3 || outlier_params.window % 2 == 0) {
+        cerr << "Error: --outlier-window must be an odd number of at least 3" << endl;
+        return -1;
+    }
+
+    map<int, Matx34f> pair_poses;
+    if (!poses_filename.empty() && !loadPairPoses(poses_filename, pair_poses))
+        return -1;
+    VoxelGrid fused(voxel_size > 0 ? voxel_size : 1.f);
+    PointCloudSink cloud_sink;
+    OctreeWriter octree;
+    if (!octree_dir.empty() && !octree.open(octree_dir))
+        return -1;
+
+    if (!dump_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(dump_dir, ec);
+        if (ec) {
+            cerr << "Failed to create dump directory " << dump_dir << ": " << ec.message() << endl;
+            return -1;
+        }
+    }
+
     enum { STEREO_BM = 0, STEREO_SGBM = 1, STEREO_HH = 2, STEREO_VAR = 3, STEREO_3WAY = 4, STEREO_HH4 = 5 };
     int alg = algorithm == "bm" ? STEREO_BM :
         algorithm == "sgbm" ? STEREO_SGBM :
@@ -111,55 +869,77 @@ int main2(int argc, char** argv)
         return -1;
     }
 
+    // Outputs that carry per-point color taken from the left image.
+    const bool color_outputs = !point_cloud_filename.empty() || !fuse_filename.empty() || !octree_dir.empty() ||
+        !organized_filename.empty() || (!mesh_filename.empty() && mesh_format == "ply");
+    // Single-channel matching input is decoded straight to gray; with --gray the
+    // left color image is kept (unrectified) only when an output needs color
+    // and is rectified lazily once the color source is built.
+    const bool gray_input = match_gray || alg == STEREO_BM;
+    const bool keep_color = match_gray && color_outputs;
+    CalibBundle bundle;
+    if (!bundle_filename.empty() && !bundle.load(bundle_filename)) {
+        cerr << "Failed to load calibration bundle " << bundle_filename << endl;
+        return -1;
+    }
+    const bool rectify = !bundle_filename.empty() ||
+        (!intrinsic_filename.empty() && !extrinsic_filename.empty());
+    StereoRectification rect;
+
+    vector<PairTiming> timings;
+    Mat prior_disp;
+    Mat disp_gray_lut, disp_color_lut;
+    double disp_lut_scale = 0;
     string left_path, right_path;
     int pair_idx = 0;
     while (infile >> left_path >> right_path) {
         cout << "\n[INFO] Processing pair #" << ++pair_idx << ": " << left_path << " " << right_path << endl;
 
-        Mat img1 = imread(left_path, alg == STEREO_BM ? IMREAD_GRAYSCALE : IMREAD_COLOR);
-        Mat img2 = imread(right_path, alg == STEREO_BM ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+        PairTiming timing;
+        timing.pair_idx = pair_idx;
+        timing.left = left_path;
+        timing.right = right_path;
+
+        Mat img1, img2, color1;
+        {
+            StageTimer timer(timing, STAGE_LOAD);
+            if (keep_color) {
+                color1 = imread(left_path, IMREAD_COLOR);
+                if (!color1.empty())
+                    cvtColor(color1, img1, COLOR_BGR2GRAY);
+            }
+            else {
+                img1 = imread(left_path, gray_input ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+            }
+            img2 = imread(right_path, gray_input ? IMREAD_GRAYSCALE : IMREAD_COLOR);
+            if (!img1.empty() && !img2.empty() && scale != 1.f) {
+                resize(img1, img1, Size(), scale, scale);
+                resize(img2, img2, Size(), scale, scale);
+                if (!color1.empty())
+                    resize(color1, color1, Size(), scale, scale);
+            }
+        }
         if (img1.empty() || img2.empty()) {
             cerr << "Could not load image pair: " << left_path << ", " << right_path << endl;
             continue;
         }
 
-        if (scale != 1.f) {
-            resize(img1, img1, Size(), scale, scale);
-            resize(img2, img2, Size(), scale, scale);
-        }
-
         Size img_size = img1.size();
-        Rect roi1, roi2;
         Mat Q;
 
-        if (!intrinsic_filename.empty() && !extrinsic_filename.empty()) {
-            FileStorage fs(intrinsic_filename, FileStorage::READ);
-            if (!fs.isOpened()) {
-                cerr << "Failed to open intrinsic file." << endl;
-                return -1;
-            }
-            Mat M1, D1, M2, D2;
-            fs["M1"] >> M1; fs["D1"] >> D1;
-            fs["M2"] >> M2; fs["D2"] >> D2;
-            M1 *= scale; M2 *= scale;
-
-            fs.open(extrinsic_filename, FileStorage::READ);
-            if (!fs.isOpened()) {
-                cerr << "Failed to open extrinsic file." << endl;
-                return -1;
+        if (rectify) {
+            StageTimer timer(timing, STAGE_RECTIFY);
+            if (rect.size != img_size) {
+                if (!bundle_filename.empty())
+                    rectificationFromBundle(bundle, scale, img_size, rect);
+                else if (!loadRectification(intrinsic_filename, extrinsic_filename, scale, img_size, rect))
+                    return -1;
             }
-            Mat R, T, R1, P1, R2, P2;
-            fs["R"] >> R; fs["T"] >> T;
-
-            stereoRectify(M1, D1, M2, D2, img_size, R, T, R1, R2, P1, P2, Q,
-                CALIB_ZERO_DISPARITY, -1, img_size, &roi1, &roi2);
-            Mat map11, map12, map21, map22;
-            initUndistortRectifyMap(M1, D1, R1, P1, img_size, CV_16SC2, map11, map12);
-            initUndistortRectifyMap(M2, D2, R2, P2, img_size, CV_16SC2, map21, map22);
+            Q = rect.Q;
 
             Mat img1r, img2r;
-            remap(img1, img1r, map11, map12, INTER_LINEAR);
-            remap(img2, img2r, map21, map22, INTER_LINEAR);
+            remap(img1, img1r, rect.map1[0], rect.map2[0], INTER_LINEAR);
+            remap(img2, img2r, rect.map1[1], rect.map2[1], INTER_LINEAR);
             img1 = img1r; img2 = img2r;
         }
 
@@ -172,7 +952,8 @@ int main2(int argc, char** argv)
         bm->setNumDisparities(numberOfDisparities);
         bm->setTextureThreshold(10);
         bm->setUniquenessRatio(15);
-        bm->setSpeckleWindowSize(100);
+        // The post-filter stage replaces the matchers' own speckle filtering.
+        bm->setSpeckleWindowSize(post_filter ? 0 : 100);
         bm->setSpeckleRange(32);
         bm->setDisp12MaxDiff(1);
 
@@ -185,7 +966,7 @@ int main2(int argc, char** argv)
         sgbm->setMinDisparity(0);
         sgbm->setNumDisparities(numberOfDisparities);
         sgbm->setUniquenessRatio(10);
-        sgbm->setSpeckleWindowSize(100);
+        sgbm->setSpeckleWindowSize(post_filter ? 0 : 100);
         sgbm->setSpeckleRange(32);
         sgbm->setDisp12MaxDiff(1);
 
@@ -200,57 +981,269 @@ int main2(int argc, char** argv)
 
         Mat disp, disp8;
         float multiplier = 1.0f;
-        int64 t = getTickCount();
-        //ɽͼ
-        imwrite("1.jpg",img1);
-        imwrite("2.jpg", img2);
-        if (alg == STEREO_BM) {
-            bm->compute(img1, img2, disp);
-            multiplier = 16.0f;
+        if (!dump_dir.empty()) {
+            imwrite(dump_dir + "/rectified_left_" + to_string(pair_idx) + ".png", img1);
+            imwrite(dump_dir + "/rectified_right_" + to_string(pair_idx) + ".png", img2);
         }
-        else {
-            sgbm->compute(img1, img2, disp);
+        Ptr<StereoMatcher> matcher = alg == STEREO_BM ? Ptr<StereoMatcher>(bm) : Ptr<StereoMatcher>(sgbm);
+        vector<SearchBand> bands;
+        const PairMatcher match = [&](const Mat& left, const Mat& right, Mat& out) {
+            if (bands.empty()) {
+                matcher->compute(left, right, out);
+                return;
+            }
+            int fallbacks = computeBanded(matcher, left, right, bands, seq_context_rows, seq_max_extra_suspect, out);
+            if (fallbacks)
+                cout << "Sequence prior: " << fallbacks << " bands re-matched with the full range" << endl;
+        };
+        {
+            StageTimer timer(timing, STAGE_MATCH);
+            if (sequence_mode && prior_disp.size() == img1.size()) {
+                bands = planSearchBands(prior_disp, seq_band_rows, matcher->getMinDisparity(),
+                    numberOfDisparities, seq_margin, seq_min_valid_fraction);
+                int narrowed = 0;
+                double searched = 0;
+                for (const SearchBand& band : bands) {
+                    narrowed += band.narrowed;
+                    searched += (double)band.num_disparities * (band.y1 - band.y0);
+                }
+                cout << "Sequence prior: " << narrowed << "/" << bands.size() << " bands narrowed, search range "
+                    << 100. * searched / ((double)numberOfDisparities * img1.rows) << "% of full" << endl;
+                if (!narrowed)
+                    bands.clear();
+            }
+            match(img1, img2, disp);
             multiplier = 16.0f;
         }
+        Mat confidence;
+        if (post_filter) {
+            StageTimer timer(timing, STAGE_POSTFILTER);
+            postFilterDisparity(disp, matcher, match, img1, img2, post_params, confidence);
+        }
+        if (sequence_mode)
+            prior_disp = disp;
+        if (!dump_dir.empty()) {
+            // Raw fixed-point disparity; invalid (negative) values saturate to 0.
+            Mat raw;
+            disp.convertTo(raw, CV_16U);
+            imwrite(dump_dir + "/disparity_raw_" + to_string(pair_idx) + ".png", raw);
+            if (!confidence.empty())
+                imwrite(dump_dir + "/confidence_" + to_string(pair_idx) + ".png", confidence);
+        }
 
-        t = getTickCount() - t;
-        cout << "Elapsed time: " << t * 1000 / getTickFrequency() << "ms\n";
+        const bool fuse_pair = (!fuse_filename.empty() || !octree_dir.empty()) && !Q.empty();
+        const bool want_points = (!point_cloud_filename.empty() || fuse_pair) && !Q.empty();
+        const bool want_organized = !organized_filename.empty() && !Q.empty();
+        const bool want_mesh = !mesh_filename.empty() && !Q.empty();
+        const bool want_planes = !plane_filename.empty() && !Q.empty();
+        const bool want_depth = !depth_filename.empty() && !Q.empty();
+        const bool want_color = color_outputs && !Q.empty();
 
-        disp.convertTo(disp8, CV_8U, 255 / (numberOfDisparities * multiplier));
-        Mat disp_color;
-        if (color_display)
-            applyColorMap(disp8, disp_color, COLORMAP_TURBO);
+        // The visualization is only computed for its consumers: the disparity
+        // image, the window, and the gray fallback color for the clouds.
+        const bool show_disparity = !disparity_filename.empty() || !no_display;
+        const bool gray_color_source = want_color && color1.empty() && img1.channels() != 3;
+        Mat disp_vis;
+        if (show_disparity || gray_color_source) {
+            StageTimer timer(timing, STAGE_COLORMAP);
+            double vis_scale = 255 / (numberOfDisparities * multiplier);
+            if (vis_scale != disp_lut_scale) {
+                buildDisparityLut(vis_scale, disp_gray_lut, disp_color_lut);
+                disp_lut_scale = vis_scale;
+            }
+            if (gray_color_source || !color_display)
+                applyDisparityLut<uchar>(disp, disp_gray_lut, disp8);
+            if (show_disparity) {
+                if (color_display)
+                    applyDisparityLut<Vec3b>(disp, disp_color_lut, disp_vis);
+                else
+                    disp_vis = disp8;
+            }
+        }
 
         if (!disparity_filename.empty()) {
+            StageTimer timer(timing, STAGE_WRITE);
             ostringstream oss;
             oss << disparity_filename << "_" << pair_idx << ".png";
-            imwrite(oss.str(), color_display ? disp_color : disp8);
+            imwrite(oss.str(), disp_vis);
         }
 
+        Mat color_source;
+        if (want_color) {
+            // Use original color image or grayscale image as color source
+            if (!color1.empty()) {
+                StageTimer timer(timing, STAGE_RECTIFY);
+                remap(color1, color_source, rect.map1[0], rect.map2[0], INTER_LINEAR);
+            }
+            else {
+                color_source = (img1.channels() == 3) ? img1 : disp8;
+            }
+        }
 
+        // The organized cloud is shared by the outlier filter, the PCD, the
+        // mesh and the plane fit. Points rejected by the filter are dropped
+        // from the unorganized cloud and the depth map through a copy of the
+        // disparity; disp itself may still be referenced as the sequence prior.
+        Mat xyz, cloud_disp = disp;
+        if (want_organized || want_mesh || want_planes || ((want_points || want_depth) && outlier_filter)) {
+            StageTimer timer(timing, STAGE_REPROJECT);
+            reprojectOrganized(disp, Q, 0, max_point_z, xyz);
+        }
+        if (outlier_filter && !xyz.empty()) {
+            StageTimer timer(timing, STAGE_OUTLIER);
+            Mat rejected;
+            int removed = filterGridOutliers(xyz, outlier_params, rejected);
+            cout << "Outlier filter: removed " << removed << " points" << endl;
+            if (want_points || want_depth) {
+                cloud_disp = disp.clone();
+                cloud_disp.setTo(Scalar(-1), rejected);
+            }
+        }
 
-        if (!point_cloud_filename.empty() && !Q.empty()) {
-            Mat xyz, float_disp;
-            disp.convertTo(float_disp, CV_32F, 1.0f / multiplier);
-            reprojectImageTo3D(float_disp, xyz, Q, true);
+        if (want_depth) {
+            Mat depth;
+            {
+                StageTimer timer(timing, STAGE_REPROJECT);
+                disparityToDepth(cloud_disp, Q, 0, max_point_z, depth_scale, depth_format == "png" ? CV_16U : CV_32F, depth);
+            }
+            StageTimer timer(timing, STAGE_WRITE);
+            ostringstream oss;
+            oss << depth_filename << "_" << pair_idx << "." << depth_format;
+            vector<int> params;
+            if (depth_format == "png")
+                params = { IMWRITE_PNG_COMPRESSION, 1 };
+            imwrite(oss.str(), depth, params);
+        }
 
+        if (want_points) {
+            string cloud_name;
+            if (!point_cloud_filename.empty()) {
+                ostringstream oss;
+                oss << point_cloud_filename << "_" << pair_idx << "." << cloud_format;
+                cloud_name = oss.str();
+            }
+            // Without fusion or downsampling the reprojected row chunks go
+            // straight to the writer thread as they are produced.
+            const bool stream_points = !cloud_name.empty() && !fuse_pair && voxel_size <= 0;
+            vector<ColoredPoint> points;
+            {
+                StageTimer timer(timing, STAGE_REPROJECT);
+                if (!stream_points) {
+                    reprojectColoredPoints(cloud_disp, Q, color_source, 0, max_point_z, points);
+                }
+                else if (cloud_sink.open(cloud_name, PointCloudSink::formatFor(cloud_name))) {
+                    // Nothing else uses the streamed points, so they are only
+                    // reprojected when the file could be opened.
+                    int nchunks = reprojectColoredPoints(cloud_disp, Q, color_source, 0, max_point_z, points,
+                        &cloud_sink);
+                    cloud_sink.close(nchunks);
+                }
+            }
+            if (fuse_pair) {
+                // Raw points go into the fused grid so every voxel averages
+                // all observations, not per-pair centroids.
+                StageTimer timer(timing, STAGE_FUSE);
+                map<int, Matx34f>::const_iterator pose = pair_poses.find(pair_idx);
+                if (!poses_filename.empty() && pose == pair_poses.end()) {
+                    cerr << "No pose for pair #" << pair_idx << ", not fused" << endl;
+                }
+                else {
+                    const Matx34f pair_pose = pose != pair_poses.end() ? pose->second : Matx34f::eye();
+                    if (!fuse_filename.empty())
+                        fused.insert(points, pair_pose);
+                    if (!octree_dir.empty())
+                        octree.add(points, pair_pose);
+                }
+            }
+            if (!cloud_name.empty() && !stream_points) {
+                if (voxel_size > 0) {
+                    StageTimer timer(timing, STAGE_DOWNSAMPLE);
+                    size_t raw_count = points.size();
+                    VoxelGrid grid(voxel_size);
+                    grid.insert(points);
+                    grid.extract(points);
+                    cout << "Voxel grid: " << raw_count << " -> " << points.size() << " points" << endl;
+                }
 
-            ostringstream oss;
-            oss << point_cloud_filename << "_" << pair_idx << ".xyz";
+                StageTimer timer(timing, STAGE_WRITE);
+                if (cloud_sink.open(cloud_name, PointCloudSink::formatFor(cloud_name))) {
+                    cloud_sink.write(0, std::move(points));
+                    cloud_sink.close(1);
+                }
+            }
+        }
 
-            // Use original color image or grayscale image as color source
-            Mat color_source = (img1.channels() == 3) ? img1 : disp8;
-            saveColoredXYZ(oss.str().c_str(), xyz, color_source);
+        if (want_organized) {
+            Mat normals;
+            {
+                StageTimer timer(timing, STAGE_REPROJECT);
+                computeGridNormals(xyz, normals);
+            }
+            StageTimer timer(timing, STAGE_WRITE);
+            ostringstream oss;
+            oss << organized_filename << "_" << pair_idx << ".pcd";
+            saveOrganizedPCD(oss.str(), xyz, color_source, normals);
+        }
+        if (want_mesh) {
+            TriangleMesh mesh;
+            {
+                StageTimer timer(timing, STAGE_MESH);
+                meshOrganizedGrid(xyz, color_source, mesh_params, mesh);
+            }
+            StageTimer timer(timing, STAGE_WRITE);
+            ostringstream oss;
+            oss << mesh_filename << "_" << pair_idx << "." << mesh_format;
+            if (mesh_format == "stl")
+                saveMeshSTL(oss.str(), mesh);
+            else
+                saveMeshPLY(oss.str(), mesh);
+        }
+        if (want_planes) {
+            vector<PlaneModel> planes;
+            Mat deviation, deviation_color;
+            {
+                StageTimer timer(timing, STAGE_PLANE);
+                fitPlanes(xyz, plane_params, planes);
+                computePlaneDeviation(xyz, planes, deviation);
+                colorizeDeviation(deviation, deviation_range, deviation_color);
+            }
+            for (size_t i = 0; i < planes.size(); i++)
+                printf("Plane %d: n = (%.4f, %.4f, %.4f), d = %.3f, %d inliers, rms %.3f\n", (int)i,
+                    planes[i].coeffs[0], planes[i].coeffs[1], planes[i].coeffs[2], planes[i].coeffs[3],
+                    planes[i].inliers, planes[i].rms);
+            StageTimer timer(timing, STAGE_WRITE);
+            ostringstream oss;
+            oss << plane_filename << "_" << pair_idx;
+            imwrite(oss.str() + ".png", deviation_color);
+            savePlanes(oss.str() + ".yml", planes, deviation);
         }
 
+        printPairTiming(timing);
+        timings.push_back(timing);
+
         if (!no_display) {
             imshow("left", img1);
             imshow("right", img2);
-            imshow("disparity", color_display ? disp_color : disp8);
+            imshow("disparity", disp_vis);
             cout << "Press ESC to continue to next pair..." << endl;
             if (waitKey(0) == 27) continue;
         }
     }
 
-    return 0;
+    if (!fuse_filename.empty()) {
+        vector<ColoredPoint> points;
+        fused.extract(points);
+        if (cloud_sink.open(fuse_filename, PointCloudSink::formatFor(fuse_filename))) {
+            cloud_sink.write(0, std::move(points));
+            cloud_sink.close(1);
+        }
+    }
+    // The sink and the octree writer have already reported what failed.
+    bool clouds_ok = octree_dir.empty() || octree.close();
+    clouds_ok = cloud_sink.finish() && clouds_ok;
+
+    if (!report_filename.empty())
+        writeTimingReport(report_filename, timings);
+
+    return clouds_ok ? 0 : -1;
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <chrono>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 #include <sys/stat.h>
@@ -19,6 +21,7 @@
 #include "opencv2/core.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
+#include "opencv2/calib3d.hpp"
 #include "MvCameraControl.h"
 
 using namespace std;
@@ -56,6 +59,242 @@ bool SetResolution(void* handle, int width, int height)
     return ret == MV_OK;
 }
 
+// ====================== Capture coverage ======================
+// A detector on downscaled left frames tracks which parts of the image and
+// which board tilts the saved pairs already cover, so capture can stop once
+// new views no longer add information. Detection runs on its own thread and
+// only ever sees the newest frame, so the grab loop is never slowed down.
+
+enum CoverageMode { COVERAGE_OFF = 0, COVERAGE_SUGGEST = 1, COVERAGE_AUTO = 2 };
+
+static const int coverageGridX = 8, coverageGridY = 6;
+static const int coverageTiltBins = 9;          // 3 horizontal x 3 vertical tilt classes
+static const int coverageDetectWidth = 640;
+static const int coverageMinGain = 2;           // new cells (tilt counts 3) worth a capture
+static const int coverageAutoIntervalMs = 1500;
+
+class CoverageTracker
+{
+public:
+    CoverageTracker() : cellCount_(coverageGridX * coverageGridY, 0), tiltCount_(coverageTiltBins, 0) {}
+    ~CoverageTracker() { Stop(); }
+
+    // boardSize is the inner corner count, as passed to the calibration tools
+    // with -w/-h.
+    void Start(CoverageMode mode, cv::Size boardSize)
+    {
+        mode_ = mode;
+        boardSize_ = boardSize;
+        if (mode_ != COVERAGE_OFF)
+            worker_ = std::thread(&CoverageTracker::DetectLoop, this);
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    bool Enabled() const { return mode_ != COVERAGE_OFF; }
+
+    // Called with every left frame; the frame is only downscaled and handed
+    // over when the detector is idle.
+    void Submit(const cv::Mat& frame)
+    {
+        if (!Enabled() || busy_.load())
+            return;
+        double sf = (double)coverageDetectWidth / frame.cols;
+        cv::Mat small, gray;
+        cv::resize(frame, small, cv::Size(), sf, sf, cv::INTER_AREA);
+        if (small.channels() == 3)
+            cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+        else
+            gray = small;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ = gray;
+            busy_ = true;
+        }
+        cond_.notify_all();
+    }
+
+    // Adds the most recent detection to the coverage; called when a pair is
+    // saved. Detections older than half a second are ignored.
+    void CommitLatest()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!latest_.valid || std::chrono::steady_clock::now() - latest_.stamp > std::chrono::milliseconds(500))
+            return;
+        CommitLocked(latest_);
+    }
+
+    // Returns the rendered coverage map if it changed since the last call.
+    bool TakeView(cv::Mat& view)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!viewUpdated_)
+            return false;
+        // The detector thread renders into view_ again while the caller shows it.
+        view = view_.clone();
+        viewUpdated_ = false;
+        return true;
+    }
+
+private:
+    struct Pose
+    {
+        bool valid = false;
+        std::vector<cv::Point2f> corners;   // detection-scale coordinates
+        std::vector<int> cells;
+        int tiltBin = 0;
+        int gain = 0;
+        std::chrono::steady_clock::time_point stamp;
+    };
+
+    // Perspective makes the board edge closer to the camera longer, so the
+    // ratio of opposite edges classifies the tilt around each axis.
+    static int TiltClass(double a, double b)
+    {
+        double r = a / std::max(b, 1e-6);
+        return r < 0.9 ? 0 : r > 1.1 ? 2 : 1;
+    }
+
+    void EvaluateLocked(Pose& pose, cv::Size size) const
+    {
+        const std::vector<cv::Point2f>& c = pose.corners;
+        int w = boardSize_.width, h = boardSize_.height;
+        cv::Point2f tl = c[0], tr = c[w - 1], bl = c[(h - 1) * w], br = c[w * h - 1];
+        int tx = TiltClass(cv::norm(bl - tl), cv::norm(br - tr));
+        int ty = TiltClass(cv::norm(tr - tl), cv::norm(br - bl));
+        pose.tiltBin = ty * 3 + tx;
+
+        std::vector<bool> hit(cellCount_.size(), false);
+        for (size_t i = 0; i < c.size(); i++)
+        {
+            int cx = std::min(std::max((int)(c[i].x * coverageGridX / size.width), 0), coverageGridX - 1);
+            int cy = std::min(std::max((int)(c[i].y * coverageGridY / size.height), 0), coverageGridY - 1);
+            hit[cy * coverageGridX + cx] = true;
+        }
+        pose.cells.clear();
+        pose.gain = tiltCount_[pose.tiltBin] == 0 ? 3 : 0;
+        for (size_t i = 0; i < hit.size(); i++)
+        {
+            if (!hit[i]) continue;
+            pose.cells.push_back((int)i);
+            if (cellCount_[i] == 0) pose.gain++;
+        }
+    }
+
+    void CommitLocked(const Pose& pose)
+    {
+        for (size_t i = 0; i < pose.cells.size(); i++)
+            cellCount_[pose.cells[i]]++;
+        tiltCount_[pose.tiltBin]++;
+        int cells = (int)std::count_if(cellCount_.begin(), cellCount_.end(), [](int n) { return n > 0; });
+        int tilts = (int)std::count_if(tiltCount_.begin(), tiltCount_.end(), [](int n) { return n > 0; });
+        printf("Coverage: %d/%d image cells, %d/%d tilt classes\n",
+            cells, (int)cellCount_.size(), tilts, coverageTiltBins);
+    }
+
+    void RenderLocked(const cv::Mat& gray, const Pose& pose)
+    {
+        cv::cvtColor(gray, view_, cv::COLOR_GRAY2BGR);
+        cv::Mat tint(view_.size(), CV_8UC3, cv::Scalar::all(0));
+        for (int cy = 0; cy < coverageGridY; cy++)
+            for (int cx = 0; cx < coverageGridX; cx++)
+            {
+                cv::Rect cell(cx * view_.cols / coverageGridX, cy * view_.rows / coverageGridY,
+                    view_.cols / coverageGridX, view_.rows / coverageGridY);
+                int n = cellCount_[cy * coverageGridX + cx];
+                tint(cell).setTo(n == 0 ? cv::Scalar(0, 0, 160) : cv::Scalar(0, std::min(60 + 40 * n, 220), 0));
+            }
+        cv::addWeighted(view_, 0.7, tint, 0.3, 0, view_);
+
+        if (pose.valid)
+            cv::drawChessboardCorners(view_, boardSize_, pose.corners, true);
+
+        int tilts = (int)std::count_if(tiltCount_.begin(), tiltCount_.end(), [](int n) { return n > 0; });
+        std::string msg = pose.valid ?
+            cv::format("gain %d%s  tilt %d/%d", pose.gain, pose.gain >= coverageMinGain ? " - capture!" : "", tilts, coverageTiltBins) :
+            cv::format("no board  tilt %d/%d", tilts, coverageTiltBins);
+        cv::putText(view_, msg, cv::Point(10, 24), cv::FONT_HERSHEY_SIMPLEX, 0.6,
+            pose.valid && pose.gain >= coverageMinGain ? cv::Scalar(0, 255, 255) : cv::Scalar(255, 255, 255), 2);
+        viewUpdated_ = true;
+    }
+
+    void DetectLoop()
+    {
+        std::chrono::steady_clock::time_point lastAuto;
+        for (;;)
+        {
+            cv::Mat gray;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+                if (stop_) break;
+                gray = pending_;
+                pending_.release();
+            }
+
+            Pose pose;
+            pose.valid = cv::findChessboardCorners(gray, boardSize_, pose.corners,
+                cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK);
+            pose.stamp = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool stable = false;
+            if (pose.valid)
+            {
+                EvaluateLocked(pose, gray.size());
+                // The board counts as held still when no corner moved more
+                // than a few pixels since the previous detection.
+                if (latest_.valid && latest_.corners.size() == pose.corners.size())
+                {
+                    double maxShift = 0;
+                    for (size_t i = 0; i < pose.corners.size(); i++)
+                        maxShift = std::max(maxShift, cv::norm(pose.corners[i] - latest_.corners[i]));
+                    stable = maxShift < 3.0;
+                }
+            }
+            latest_ = pose;
+
+            if (mode_ == COVERAGE_AUTO && stable && pose.gain >= coverageMinGain && !globalSave.load() &&
+                pose.stamp - lastAuto > std::chrono::milliseconds(coverageAutoIntervalMs))
+            {
+                printf("Auto capture: pose adds %d to coverage\n", pose.gain);
+                CommitLocked(pose);
+                EvaluateLocked(latest_, gray.size());
+                saveCount = 2;
+                ++saveGroupID;
+                globalSave = true;
+                lastAuto = pose.stamp;
+            }
+            RenderLocked(gray, latest_);
+            busy_ = false;
+        }
+    }
+
+    CoverageMode mode_ = COVERAGE_OFF;
+    cv::Size boardSize_;
+    std::vector<int> cellCount_;
+    std::vector<int> tiltCount_;
+    Pose latest_;
+    cv::Mat pending_;
+    cv::Mat view_;
+    bool viewUpdated_ = false;
+    bool stop_ = false;
+    std::atomic<bool> busy_{ false };
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread worker_;
+};
+
+CoverageTracker coverage;
+
 void CameraThread(CameraHandle* cam, bool isSingle = false)
 {
     while (!cam->readyToStart && globalRunning)
@@ -101,6 +340,13 @@ void CameraThread(CameraHandle* cam, bool isSingle = false)
             if (!frame.empty())
             {
                 cv::imshow(cam->windowName, frame);
+                if (!isSingle && cam->index == 0 && coverage.Enabled())
+                {
+                    coverage.Submit(frame);
+                    cv::Mat view;
+                    if (coverage.TakeView(view))
+                        cv::imshow("coverage", view);
+                }
                 cv::waitKey(1);
 
                 if (globalSave.load())
@@ -209,6 +455,23 @@ void RunDualCameraMode()
         MV_CC_SetFloatValue(cams[i].handle, "Gamma", 0.37f);
     }
 
+    int coverageMode;
+    printf("Capture guidance (0 = off, 1 = show coverage, 2 = auto capture new poses): ");
+    std::cin >> coverageMode;
+    cv::Size boardSize;
+    if (coverageMode == 1 || coverageMode == 2)
+    {
+        printf("Board inner corners, as -w/-h of the calibration tools (width height): ");
+        std::cin >> boardSize.width >> boardSize.height;
+        if (!std::cin || boardSize.width < 2 || boardSize.height < 2)
+        {
+            printf("Invalid board size, capture guidance disabled.\n");
+            std::cin.clear();
+            coverageMode = 0;
+        }
+    }
+    coverage.Start(coverageMode == 2 ? COVERAGE_AUTO : coverageMode == 1 ? COVERAGE_SUGGEST : COVERAGE_OFF, boardSize);
+
     std::thread t[2] = {
         std::thread([&]() { CameraThread(&cams[0]); }),
         std::thread([&]() { CameraThread(&cams[1]); })
@@ -220,9 +483,10 @@ void RunDualCameraMode()
         int key = getchar();
         if (key == 's' || key == 'S')
         {
-            globalSave = true;
+            coverage.CommitLatest();
             saveCount = 2;
             ++saveGroupID;
+            globalSave = true;
         }
         else if (key == 'q' || key == 'Q')
         {
@@ -230,6 +494,7 @@ void RunDualCameraMode()
         }
     }
 
+    coverage.Stop();
     for (int i = 0; i < 2; ++i)
     {
         cams[i].isRunning = false;
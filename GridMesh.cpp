@@ -0,0 +1,349 @@
+#include "GridMesh.h"
+
+#include "opencv2/core/utility.hpp"
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+static inline bool validPoint(const Vec3f& p)
+{
+    return p[2] == p[2];
+}
+
+// Faces are collected with pixel indices (y * cols + x) and only renumbered to
+// compact vertex indices once all bands are done.
+struct GridMesher
+{
+    const Mat& xyz;
+    const GridMeshParams& params;
+
+    GridMesher(const Mat& xyz_, const GridMeshParams& params_) : xyz(xyz_), params(params_) {}
+
+    const Vec3f& at(int x, int y) const { return xyz.at<Vec3f>(y, x); }
+
+    bool continuous(const Vec3f& a, const Vec3f& b, const Vec3f& c) const
+    {
+        float zmin = std::min(a[2], std::min(b[2], c[2]));
+        float zmax = std::max(a[2], std::max(b[2], c[2]));
+        return zmax - zmin <= params.max_depth_jump * std::min(fabsf(zmin), fabsf(zmax));
+    }
+
+    void addTriangle(int x0, int y0, int x1, int y1, int x2, int y2, vector<Vec3i>& faces) const
+    {
+        const Vec3f &a = at(x0, y0), &b = at(x1, y1), &c = at(x2, y2);
+        if (validPoint(a) && validPoint(b) && validPoint(c) && continuous(a, b, c))
+            faces.push_back(Vec3i(y0 * xyz.cols + x0, y1 * xyz.cols + x1, y2 * xyz.cols + x2));
+    }
+
+    // Quad with corners (x, y) and (x + s, y + s) split along the same
+    // diagonal as the full-resolution cells. With one corner missing the
+    // triangle of the other three is kept.
+    void addQuad(int x, int y, int s, vector<Vec3i>& faces) const
+    {
+        int x1 = x + s, y1 = y + s;
+        bool v00 = validPoint(at(x, y)), v10 = validPoint(at(x1, y));
+        bool v01 = validPoint(at(x, y1)), v11 = validPoint(at(x1, y1));
+        if (v00 && v10 && v01 && v11) {
+            addTriangle(x, y, x, y1, x1, y, faces);
+            addTriangle(x1, y, x, y1, x1, y1, faces);
+        }
+        else if (v10 && v01 && v11)
+            addTriangle(x1, y, x, y1, x1, y1, faces);
+        else if (v00 && v01 && v11)
+            addTriangle(x, y, x, y1, x1, y1, faces);
+        else if (v00 && v10 && v11)
+            addTriangle(x, y, x1, y1, x1, y, faces);
+        else if (v00 && v10 && v01)
+            addTriangle(x, y, x, y1, x1, y, faces);
+    }
+
+    // True if every point of the block is valid, free of depth jumps and
+    // within flat_tolerance of the plane through the block corners.
+    bool flat(int x, int y, int s) const
+    {
+        const Vec3f &p00 = at(x, y), &p10 = at(x + s, y), &p01 = at(x, y + s), &p11 = at(x + s, y + s);
+        if (!validPoint(p00) || !validPoint(p10) || !validPoint(p01) || !validPoint(p11))
+            return false;
+        Vec3f n = (p11 - p00).cross(p01 - p10);
+        float len = std::sqrt(n.dot(n));
+        if (len < FLT_EPSILON)
+            return false;
+        n *= 1.f / len;
+        Vec3f center = (p00 + p10 + p01 + p11) * 0.25f;
+        float zmin = FLT_MAX, zmax = -FLT_MAX;
+        for (int yy = y; yy <= y + s; yy++) {
+            const Vec3f* row = xyz.ptr<Vec3f>(yy);
+            for (int xx = x; xx <= x + s; xx++) {
+                const Vec3f& p = row[xx];
+                if (!validPoint(p) || fabsf(n.dot(p - center)) > params.flat_tolerance)
+                    return false;
+                zmin = std::min(zmin, p[2]);
+                zmax = std::max(zmax, p[2]);
+            }
+        }
+        return zmax - zmin <= params.max_depth_jump * std::min(fabsf(zmin), fabsf(zmax)) * s;
+    }
+
+    // Splits a block quadtree-style until its pieces are flat or single
+    // cells; the resulting leaves are (x, y, size).
+    void splitBlock(int x, int y, int s, vector<Vec3i>& leaves) const
+    {
+        if (s == 1 || (params.flat_tolerance > 0 && flat(x, y, s))) {
+            leaves.push_back(Vec3i(x, y, s));
+            return;
+        }
+        int h = s / 2;
+        splitBlock(x, y, h, leaves);
+        splitBlock(x + h, y, h, leaves);
+        splitBlock(x, y + h, h, leaves);
+        splitBlock(x + h, y + h, h, leaves);
+    }
+
+    // Leaves of the cell rows [y0, y1). Blocks that would cross the image
+    // border are split into single cells.
+    void bandLeaves(int y0, int y1, vector<Vec3i>& leaves) const
+    {
+        const int cells_x = xyz.cols - 1, cells_y = xyz.rows - 1;
+        const int s = params.max_block;
+        for (int x = 0; x < cells_x; x += s) {
+            if (x + s <= cells_x && y0 + s <= cells_y && y1 - y0 == s) {
+                splitBlock(x, y0, s, leaves);
+                continue;
+            }
+            for (int y = y0; y < y1; y++)
+                for (int xx = x; xx < std::min(x + s, cells_x); xx++)
+                    leaves.push_back(Vec3i(xx, y, 1));
+        }
+    }
+};
+
+// Pixels that are a corner of some leaf. Every band marks the corners of its
+// own leaves in a private buffer covering its rows y0..y1 inclusive, so the
+// marking needs no synchronization; the row shared by two bands is looked up
+// in both.
+struct LeafCorners
+{
+    int cols, band_rows;
+    vector<vector<uchar> > bands;
+
+    LeafCorners(int cols_, int band_rows_, int nbands) : cols(cols_), band_rows(band_rows_), bands(nbands) {}
+
+    void mark(int b, int y0, int y1, const vector<Vec3i>& leaves)
+    {
+        vector<uchar>& m = bands[b];
+        m.assign((size_t)(y1 - y0 + 1) * cols, 0);
+        for (const Vec3i& l : leaves) {
+            uchar* top = &m[(size_t)(l[1] - y0) * cols + l[0]];
+            uchar* bottom = top + (size_t)l[2] * cols;
+            top[0] = top[l[2]] = bottom[0] = bottom[l[2]] = 1;
+        }
+    }
+
+    bool at(int x, int y) const
+    {
+        int b = y / band_rows;
+        if (b < (int)bands.size() && bands[b][(size_t)(y - b * band_rows) * cols + x])
+            return true;
+        return b > 0 && y % band_rows == 0 && bands[b - 1][(size_t)band_rows * cols + x];
+    }
+};
+
+// Triangulates one leaf. Single cells and merged quads without smaller
+// neighbours are split along the diagonal. A merged quad whose edges carry
+// corners of smaller neighbouring leaves is fanned from its center through
+// all of those corners instead, so both sides share every edge vertex and the
+// level change leaves no T-junction crack.
+static void meshLeaf(const GridMesher& mesher, const LeafCorners& corners, const Vec3i& leaf,
+                     vector<int>& ring, vector<Vec3i>& faces)
+{
+    const int x = leaf[0], y = leaf[1], s = leaf[2];
+    if (s == 1) {
+        mesher.addQuad(x, y, s, faces);
+        return;
+    }
+
+    // Boundary corners in the order of the diagonal split's faces: down the
+    // left edge, right along the bottom, up the right edge, back along the
+    // top. Flat blocks have every point valid, so no face is dropped.
+    const int cols = mesher.xyz.cols;
+    ring.clear();
+    for (int k = 0; k < s; k++)
+        if (k == 0 || corners.at(x, y + k))
+            ring.push_back((y + k) * cols + x);
+    for (int k = 0; k < s; k++)
+        if (k == 0 || corners.at(x + k, y + s))
+            ring.push_back((y + s) * cols + x + k);
+    for (int k = 0; k < s; k++)
+        if (k == 0 || corners.at(x + s, y + s - k))
+            ring.push_back((y + s - k) * cols + x + s);
+    for (int k = 0; k < s; k++)
+        if (k == 0 || corners.at(x + s - k, y))
+            ring.push_back(y * cols + x + s - k);
+
+    if (ring.size() == 4) {
+        faces.push_back(Vec3i(ring[0], ring[1], ring[3]));
+        faces.push_back(Vec3i(ring[3], ring[1], ring[2]));
+        return;
+    }
+    const int center = (y + s / 2) * cols + x + s / 2;
+    for (size_t i = 0; i < ring.size(); i++)
+        faces.push_back(Vec3i(center, ring[i], ring[(i + 1) % ring.size()]));
+}
+
+void meshOrganizedGrid(const Mat& xyz, const Mat& color, const GridMeshParams& params, TriangleMesh& mesh)
+{
+    CV_Assert(xyz.type() == CV_32FC3);
+    CV_Assert(color.empty() || (color.size() == xyz.size() && (color.type() == CV_8UC3 || color.type() == CV_8UC1)));
+    CV_Assert(params.max_block >= 1 && (params.max_block & (params.max_block - 1)) == 0);
+
+    mesh.vertices.clear();
+    mesh.colors.clear();
+    mesh.faces.clear();
+    if (xyz.rows < 2 || xyz.cols < 2)
+        return;
+
+    // Two passes over row bands of max_block cells: the quadtree leaves and
+    // their corners first, then the faces, once the corners of the
+    // neighbouring bands are known.
+    GridMesher mesher(xyz, params);
+    const int cells_y = xyz.rows - 1;
+    const int nbands = (cells_y + params.max_block - 1) / params.max_block;
+    vector<vector<Vec3i> > band_leaves(nbands), band_faces(nbands);
+    LeafCorners corners(xyz.cols, params.max_block, nbands);
+    parallel_for_(Range(0, nbands), [&](const Range& range) {
+        for (int b = range.start; b < range.end; b++) {
+            int y0 = b * params.max_block, y1 = std::min(y0 + params.max_block, cells_y);
+            mesher.bandLeaves(y0, y1, band_leaves[b]);
+            corners.mark(b, y0, y1, band_leaves[b]);
+        }
+    });
+    parallel_for_(Range(0, nbands), [&](const Range& range) {
+        vector<int> ring;
+        for (int b = range.start; b < range.end; b++) {
+            for (const Vec3i& leaf : band_leaves[b])
+                meshLeaf(mesher, corners, leaf, ring, band_faces[b]);
+            vector<Vec3i>().swap(band_leaves[b]);
+        }
+    });
+
+    // Number the referenced pixels in raster order and rewrite the faces.
+    vector<int> index(xyz.total(), -1);
+    size_t nfaces = 0;
+    for (const auto& faces : band_faces) {
+        nfaces += faces.size();
+        for (const Vec3i& f : faces)
+            index[f[0]] = index[f[1]] = index[f[2]] = 0;
+    }
+    const int cn = color.empty() ? 0 : color.channels();
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index[i] < 0)
+            continue;
+        index[i] = (int)mesh.vertices.size();
+        int y = (int)(i / xyz.cols), x = (int)(i % xyz.cols);
+        mesh.vertices.push_back(xyz.at<Vec3f>(y, x));
+        if (cn) {
+            const uchar* px = color.ptr<uchar>(y) + x * cn;
+            mesh.colors.push_back(cn == 3 ? Vec3b(px[2], px[1], px[0]) : Vec3b(px[0], px[0], px[0]));
+        }
+    }
+    mesh.faces.reserve(nfaces);
+    for (const auto& faces : band_faces)
+        for (const Vec3i& f : faces)
+            mesh.faces.push_back(Vec3i(index[f[0]], index[f[1]], index[f[2]]));
+}
+
+bool saveMeshPLY(const string& filename, const TriangleMesh& mesh)
+{
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename.c_str());
+        return false;
+    }
+    const bool has_color = mesh.colors.size() == mesh.vertices.size() && !mesh.colors.empty();
+    fprintf(fp, "ply\nformat binary_little_endian 1.0\nelement vertex %d\n"
+        "property float x\nproperty float y\nproperty float z\n", (int)mesh.vertices.size());
+    if (has_color)
+        fprintf(fp, "property uchar red\nproperty uchar green\nproperty uchar blue\n");
+    fprintf(fp, "element face %d\nproperty list uchar int vertex_indices\nend_header\n", (int)mesh.faces.size());
+
+    bool ok = true;
+    const size_t vsize = 3 * sizeof(float) + (has_color ? 3 : 0);
+    const size_t chunk = 4096;
+    vector<uchar> buf;
+    for (size_t i = 0; ok && i < mesh.vertices.size(); i += chunk) {
+        size_t n = std::min(chunk, mesh.vertices.size() - i);
+        buf.resize(n * vsize);
+        uchar* out = buf.data();
+        for (size_t k = i; k < i + n; k++, out += vsize) {
+            memcpy(out, mesh.vertices[k].val, 3 * sizeof(float));
+            if (has_color)
+                memcpy(out + 3 * sizeof(float), mesh.colors[k].val, 3);
+        }
+        ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    }
+    const size_t fsize = 1 + 3 * sizeof(int32_t);
+    for (size_t i = 0; ok && i < mesh.faces.size(); i += chunk) {
+        size_t n = std::min(chunk, mesh.faces.size() - i);
+        buf.resize(n * fsize);
+        uchar* out = buf.data();
+        for (size_t k = i; k < i + n; k++, out += fsize) {
+            out[0] = 3;
+            memcpy(out + 1, mesh.faces[k].val, 3 * sizeof(int32_t));
+        }
+        ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+        printf("Saved mesh (%d vertices, %d faces) to %s\n", (int)mesh.vertices.size(), (int)mesh.faces.size(), filename.c_str());
+    else
+        fprintf(stderr, "Error writing %s\n", filename.c_str());
+    return ok;
+}
+
+bool saveMeshSTL(const string& filename, const TriangleMesh& mesh)
+{
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename.c_str());
+        return false;
+    }
+    char header[80] = "binary STL from DoubleMatch organized grid mesher";
+    uint32_t count = (uint32_t)mesh.faces.size();
+    bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+        fwrite(&count, sizeof(count), 1, fp) == 1;
+
+    // 50 bytes per triangle: normal, three vertices, attribute byte count.
+    const size_t tsize = 50, chunk = 4096;
+    vector<uchar> buf;
+    for (size_t i = 0; ok && i < mesh.faces.size(); i += chunk) {
+        size_t n = std::min(chunk, mesh.faces.size() - i);
+        buf.assign(n * tsize, 0);
+        uchar* out = buf.data();
+        for (size_t k = i; k < i + n; k++, out += tsize) {
+            const Vec3f &a = mesh.vertices[mesh.faces[k][0]], &b = mesh.vertices[mesh.faces[k][1]],
+                &c = mesh.vertices[mesh.faces[k][2]];
+            Vec3f nrm = (b - a).cross(c - a);
+            float len = std::sqrt(nrm.dot(nrm));
+            if (len > 0)
+                nrm *= 1.f / len;
+            memcpy(out, nrm.val, 12);
+            memcpy(out + 12, a.val, 12);
+            memcpy(out + 24, b.val, 12);
+            memcpy(out + 36, c.val, 12);
+        }
+        ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+        printf("Saved mesh (%d faces) to %s\n", (int)count, filename.c_str());
+    else
+        fprintf(stderr, "Error writing %s\n", filename.c_str());
+    return ok;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <string>
+#include <vector>
+
+struct TriangleMesh
+{
+    std::vector<cv::Vec3f> vertices;
+    std::vector<cv::Vec3b> colors;      // RGB per vertex, empty without color
+    std::vector<cv::Vec3i> faces;       // counter-clockwise seen from the camera
+};
+
+struct GridMeshParams
+{
+    // Triangles whose depth range exceeds this fraction of their nearest
+    // depth span a discontinuity and are dropped.
+    float max_depth_jump = 0.05f;
+    // Largest decimated quad, in grid cells; must be a power of two.
+    int max_block = 16;
+    // A block is replaced by a single quad when all of its points lie within
+    // this distance (calibration units) of the plane through its corners.
+    // 0 disables decimation.
+    float flat_tolerance = 0.2f;
+};
+
+// Triangulates an organized cloud (CV_32FC3, NaN = invalid) directly on its
+// pixel grid: two triangles per valid 2x2 cell, one where a single corner is
+// missing. Flat regions are merged quadtree-style into larger quads. A merged
+// quad next to smaller ones is fanned from its center through their corners
+// on its edges, so level changes stay watertight without T-junctions. Row
+// bands of max_block rows are meshed in parallel, so the whole pass is linear
+// in the number of pixels.
+// color (BGR or gray, same size) is optional.
+void meshOrganizedGrid(const cv::Mat& xyz, const cv::Mat& color, const GridMeshParams& params,
+                       TriangleMesh& mesh);
+
+// Binary little-endian PLY with vertex colors when present.
+bool saveMeshPLY(const std::string& filename, const TriangleMesh& mesh);
+// Binary STL; colors are not stored.
+bool saveMeshSTL(const std::string& filename, const TriangleMesh& mesh);
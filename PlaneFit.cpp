@@ -0,0 +1,218 @@
+#include "PlaneFit.h"
+
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <limits>
+
+using namespace cv;
+using namespace std;
+
+static inline bool planeThrough(const Vec3f& a, const Vec3f& b, const Vec3f& c, Vec4f& plane)
+{
+    Vec3f n = (b - a).cross(c - a);
+    float len = std::sqrt(n.dot(n));
+    if (len < FLT_EPSILON)
+        return false;
+    n *= 1.f / len;
+    plane = Vec4f(n[0], n[1], n[2], -n.dot(a));
+    return true;
+}
+
+static inline float planeDistance(const Vec4f& plane, const Vec3f& p)
+{
+    return plane[0] * p[0] + plane[1] * p[1] + plane[2] * p[2] + plane[3];
+}
+
+// Least-squares plane through the points within threshold of plane: the
+// centroid and the eigenvector of the smallest covariance eigenvalue.
+static bool refinePlane(const vector<Vec3f>& points, float threshold, Vec4f& plane, int& inliers, float& rms)
+{
+    Vec3d sum(0, 0, 0);
+    Matx33d cov = Matx33d::zeros();
+    int n = 0;
+    for (const Vec3f& p : points) {
+        if (fabsf(planeDistance(plane, p)) > threshold)
+            continue;
+        Vec3d q(p[0], p[1], p[2]);
+        sum += q;
+        cov += q * q.t();
+        n++;
+    }
+    if (n < 3)
+        return false;
+    Vec3d centroid = sum * (1.0 / n);
+    cov = cov * (1.0 / n) - centroid * centroid.t();
+    Mat eigenvalues, eigenvectors;
+    eigen(Mat(cov), eigenvalues, eigenvectors);
+    Vec3d normal(eigenvectors.at<double>(2, 0), eigenvectors.at<double>(2, 1), eigenvectors.at<double>(2, 2));
+    // Face the camera at the origin.
+    if (normal.dot(centroid) > 0)
+        normal = -normal;
+    plane = Vec4f((float)normal[0], (float)normal[1], (float)normal[2], (float)-normal.dot(centroid));
+    inliers = n;
+    rms = (float)std::sqrt(std::max(eigenvalues.at<double>(2), 0.0));
+    return true;
+}
+
+// One RANSAC search over points; returns false if no plane was found.
+static bool ransacPlane(const vector<Vec3f>& points, const PlaneFitParams& params, Vec4f& best_plane)
+{
+    const int n = (int)points.size();
+    if (n < 3)
+        return false;
+    vector<Vec3f> score_points;
+    const int stride = std::max(1, n / std::max(params.max_score_points, 1));
+    for (int i = 0; i < n; i += stride)
+        score_points.push_back(points[i]);
+
+    const int batch = 64;
+    const double log_miss = log(1.0 - params.confidence);
+    int needed = params.max_iterations, best_score = 0;
+    for (int it = 0; it < needed; it += batch) {
+        const int nb = std::min(batch, needed - it);
+        vector<Vec4f> models(nb);
+        vector<int> scores(nb, 0);
+        parallel_for_(Range(0, nb), [&](const Range& range) {
+            for (int h = range.start; h < range.end; h++) {
+                RNG rng((uint64)(it + h) * 0x9E3779B97F4A7C15ULL + 1);
+                int a = rng.uniform(0, n), b = rng.uniform(0, n), c = rng.uniform(0, n);
+                if (a == b || b == c || a == c || !planeThrough(points[a], points[b], points[c], models[h]))
+                    continue;
+                int score = 0;
+                for (const Vec3f& p : score_points)
+                    score += fabsf(planeDistance(models[h], p)) <= params.inlier_threshold;
+                scores[h] = score;
+            }
+        });
+        for (int h = 0; h < nb; h++) {
+            if (scores[h] > best_score) {
+                best_score = scores[h];
+                best_plane = models[h];
+            }
+        }
+        if (best_score > 0) {
+            double w = (double)best_score / score_points.size();
+            double miss = 1.0 - w * w * w;
+            if (miss <= 0)
+                break;
+            needed = std::min(params.max_iterations, (int)ceil(log_miss / log(miss)));
+        }
+    }
+    return best_score >= 3;
+}
+
+int fitPlanes(const Mat& xyz, const PlaneFitParams& params, vector<PlaneModel>& planes)
+{
+    CV_Assert(xyz.type() == CV_32FC3);
+    planes.clear();
+
+    vector<Vec3f> points;
+    points.reserve(xyz.total());
+    for (int y = 0; y < xyz.rows; y++) {
+        const Vec3f* row = xyz.ptr<Vec3f>(y);
+        for (int x = 0; x < xyz.cols; x++)
+            if (row[x][2] == row[x][2])
+                points.push_back(row[x]);
+    }
+    const int min_inliers = std::max(3, (int)(params.min_inlier_fraction * points.size()));
+
+    while ((int)planes.size() < params.max_planes) {
+        PlaneModel model;
+        if (!ransacPlane(points, params, model.coeffs))
+            break;
+        bool ok = true;
+        for (int k = 0; ok && k < 2; k++)
+            ok = refinePlane(points, params.inlier_threshold, model.coeffs, model.inliers, model.rms);
+        if (!ok || (!planes.empty() && model.inliers < min_inliers))
+            break;
+        planes.push_back(model);
+
+        // Search the next plane among the remaining points.
+        points.erase(remove_if(points.begin(), points.end(), [&](const Vec3f& p) {
+            return fabsf(planeDistance(model.coeffs, p)) <= params.inlier_threshold;
+        }), points.end());
+    }
+    return (int)planes.size();
+}
+
+void computePlaneDeviation(const Mat& xyz, const vector<PlaneModel>& planes, Mat& deviation)
+{
+    CV_Assert(xyz.type() == CV_32FC3);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    deviation.create(xyz.size(), CV_32F);
+
+    parallel_for_(Range(0, xyz.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const Vec3f* p = xyz.ptr<Vec3f>(y);
+            float* out = deviation.ptr<float>(y);
+            for (int x = 0; x < xyz.cols; x++) {
+                out[x] = nan;
+                if (p[x][2] != p[x][2])
+                    continue;
+                for (const PlaneModel& plane : planes) {
+                    float d = planeDistance(plane.coeffs, p[x]);
+                    if (!(fabsf(out[x]) <= fabsf(d)))
+                        out[x] = d;
+                }
+            }
+        }
+    });
+}
+
+void colorizeDeviation(const Mat& deviation, float range, Mat& bgr)
+{
+    CV_Assert(deviation.type() == CV_32F && range > 0);
+    Mat level(deviation.size(), CV_8U), invalid(deviation.size(), CV_8U);
+    parallel_for_(Range(0, deviation.rows), [&](const Range& r) {
+        for (int y = r.start; y < r.end; y++) {
+            const float* d = deviation.ptr<float>(y);
+            uchar* out = level.ptr<uchar>(y);
+            uchar* bad = invalid.ptr<uchar>(y);
+            for (int x = 0; x < deviation.cols; x++) {
+                bad[x] = d[x] != d[x] ? 255 : 0;
+                out[x] = bad[x] ? 0 : saturate_cast<uchar>((d[x] / range + 1.f) * 127.5f);
+            }
+        }
+    });
+    applyColorMap(level, bgr, COLORMAP_TURBO);
+    bgr.setTo(Scalar::all(0), invalid);
+}
+
+bool savePlanes(const string& filename, const vector<PlaneModel>& planes, const Mat& deviation)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened()) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename.c_str());
+        return false;
+    }
+    fs << "planes" << "[";
+    for (const PlaneModel& plane : planes) {
+        fs << "{" << "coeffs" << Mat(plane.coeffs) << "inliers" << plane.inliers << "rms" << plane.rms << "}";
+    }
+    fs << "]";
+
+    // Flatness summary over all valid pixels.
+    double sum_abs = 0, min_dev = DBL_MAX, max_dev = -DBL_MAX;
+    int n = 0;
+    for (int y = 0; y < deviation.rows; y++) {
+        const float* d = deviation.ptr<float>(y);
+        for (int x = 0; x < deviation.cols; x++) {
+            if (d[x] != d[x])
+                continue;
+            sum_abs += fabsf(d[x]);
+            min_dev = std::min(min_dev, (double)d[x]);
+            max_dev = std::max(max_dev, (double)d[x]);
+            n++;
+        }
+    }
+    fs << "validPoints" << n;
+    if (n) {
+        fs << "minDeviation" << min_dev << "maxDeviation" << max_dev << "meanAbsDeviation" << sum_abs / n;
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <string>
+#include <vector>
+
+struct PlaneFitParams
+{
+    float inlier_threshold = 0.5f;  // point-to-plane distance, calibration units
+    int max_iterations = 2000;      // RANSAC hypotheses per plane at most
+    double confidence = 0.999;      // stop once a better plane is this unlikely
+    int max_planes = 1;
+    float min_inlier_fraction = 0.05f;  // of the valid points, for any plane after the first
+    int max_score_points = 20000;   // subsample the hypotheses are scored on
+};
+
+struct PlaneModel
+{
+    cv::Vec4f coeffs;   // unit normal facing the camera and d, n . p + d = 0
+    int inliers;
+    float rms;          // of the inlier distances
+};
+
+// RANSAC plane extraction on an organized cloud (CV_32FC3, NaN = invalid).
+// Hypotheses are drawn in batches scored in parallel on a fixed subsample; the
+// number of iterations adapts to the best inlier ratio so far and stops once
+// the confidence is reached. The winner is refined by least squares (PCA of
+// all its inliers, re-selected twice). With max_planes > 1 the inliers are
+// removed and the next plane is searched in the rest, largest first.
+// Returns the number of planes found.
+int fitPlanes(const cv::Mat& xyz, const PlaneFitParams& params, std::vector<PlaneModel>& planes);
+
+// Signed distance of every point to the nearest plane, positive towards the
+// camera; NaN where xyz is invalid. CV_32F.
+void computePlaneDeviation(const cv::Mat& xyz, const std::vector<PlaneModel>& planes, cv::Mat& deviation);
+
+// Deviation image for inspection: [-range, range] mapped through the turbo
+// colormap, invalid pixels black.
+void colorizeDeviation(const cv::Mat& deviation, float range, cv::Mat& bgr);
+
+bool savePlanes(const std::string& filename, const std::vector<PlaneModel>& planes, const cv::Mat& deviation);
@@ -0,0 +1,373 @@
+#include "PointCloud.h"
+
+#include "opencv2/core/utility.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+
+using namespace cv;
+using namespace std;
+
+// Voxel coordinates are packed into 21 bits per axis, which covers +-2^20
+// voxels around the origin; points outside are dropped.
+static const int64_t voxelKeyBias = 1 << 20;
+static const int64_t voxelKeyMask = (1 << 21) - 1;
+static const uint64_t invalidVoxelKey = ~0ULL;
+static const int voxelShards = 64;
+
+static inline uint64_t voxelKey(const ColoredPoint& p, float inv_size)
+{
+    int64_t ix = (int64_t)floorf(p.x * inv_size) + voxelKeyBias;
+    int64_t iy = (int64_t)floorf(p.y * inv_size) + voxelKeyBias;
+    int64_t iz = (int64_t)floorf(p.z * inv_size) + voxelKeyBias;
+    if (((ix | iy | iz) & ~voxelKeyMask) != 0)
+        return invalidVoxelKey;
+    return (uint64_t)ix | ((uint64_t)iy << 21) | ((uint64_t)iz << 42);
+}
+
+// Spreads neighboring voxels over different shards.
+static inline int voxelShard(uint64_t key)
+{
+    return (int)((key * 0x9E3779B97F4A7C15ULL) >> 58) & (voxelShards - 1);
+}
+
+VoxelGrid::VoxelGrid(float voxelSize) : voxelSize_(voxelSize), shards_(voxelShards)
+{
+    CV_Assert(voxelSize > 0);
+}
+
+void VoxelGrid::insert(const vector<ColoredPoint>& points)
+{
+    insert(points, Matx34f::eye());
+}
+
+void VoxelGrid::insert(const vector<ColoredPoint>& points, const Matx34f& pose)
+{
+    const float inv_size = 1.f / voxelSize_;
+    const int n = (int)points.size();
+    vector<uint64_t> keys(n);
+    parallel_for_(Range(0, n), [&](const Range& range) {
+        for (int i = range.start; i < range.end; i++)
+            keys[i] = voxelKey(transformPoint(points[i], pose), inv_size);
+    });
+
+    // Bucket point indices by shard so every shard is then accumulated by a
+    // single thread without locking.
+    vector<int> counts(voxelShards + 1, 0);
+    for (int i = 0; i < n; i++)
+        if (keys[i] != invalidVoxelKey)
+            counts[voxelShard(keys[i]) + 1]++;
+    for (int s = 0; s < voxelShards; s++)
+        counts[s + 1] += counts[s];
+    vector<int> order(counts[voxelShards]);
+    vector<int> fill(counts.begin(), counts.end() - 1);
+    for (int i = 0; i < n; i++)
+        if (keys[i] != invalidVoxelKey)
+            order[fill[voxelShard(keys[i])]++] = i;
+
+    parallel_for_(Range(0, voxelShards), [&](const Range& range) {
+        for (int s = range.start; s < range.end; s++) {
+            Shard& shard = shards_[s];
+            for (int k = counts[s]; k < counts[s + 1]; k++) {
+                ColoredPoint p = transformPoint(points[order[k]], pose);
+                Cell& c = shard[keys[order[k]]];
+                c.x += p.x; c.y += p.y; c.z += p.z;
+                c.r += p.r; c.g += p.g; c.b += p.b;
+                c.n++;
+            }
+        }
+    });
+}
+
+void VoxelGrid::extract(vector<ColoredPoint>& points) const
+{
+    points.clear();
+    points.reserve(size());
+    for (const Shard& shard : shards_) {
+        for (const auto& item : shard) {
+            const Cell& c = item.second;
+            double inv_n = 1.0 / c.n;
+            ColoredPoint p;
+            p.x = (float)(c.x * inv_n);
+            p.y = (float)(c.y * inv_n);
+            p.z = (float)(c.z * inv_n);
+            p.r = (uchar)((c.r + c.n / 2) / c.n);
+            p.g = (uchar)((c.g + c.n / 2) / c.n);
+            p.b = (uchar)((c.b + c.n / 2) / c.n);
+            points.push_back(p);
+        }
+    }
+}
+
+size_t VoxelGrid::size() const
+{
+    size_t total = 0;
+    for (const Shard& shard : shards_)
+        total += shard.size();
+    return total;
+}
+
+void VoxelGrid::clear()
+{
+    for (Shard& shard : shards_)
+        Shard().swap(shard);
+}
+
+// ====================== Organized clouds ======================
+
+DisparityReprojector::DisparityReprojector(const Mat& Q, int min_disparity, float max_z)
+    : minD16_(min_disparity * 16), maxZ_(max_z)
+{
+    CV_Assert(Q.rows == 4 && Q.cols == 4);
+    Q.convertTo(q_, CV_64F);
+    qx0_ = (float)q_(0, 0); qy0_ = (float)q_(1, 0); qz0_ = (float)q_(2, 0); qw0_ = (float)q_(3, 0);
+    qx2_ = (float)q_(0, 2); qy2_ = (float)q_(1, 2); qz2_ = (float)q_(2, 2); qw2_ = (float)q_(3, 2);
+}
+
+void reprojectOrganized(const Mat& disp, const Mat& Q, int min_disparity, float max_z, Mat& xyz)
+{
+    CV_Assert(disp.type() == CV_16SC1);
+
+    const DisparityReprojector reprojector(Q, min_disparity, max_z);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    xyz.create(disp.size(), CV_32FC3);
+
+    parallel_for_(Range(0, disp.rows), [&](const Range& range) {
+        DisparityReprojector row = reprojector;
+        for (int y = range.start; y < range.end; y++) {
+            const short* drow = disp.ptr<short>(y);
+            Vec3f* out = xyz.ptr<Vec3f>(y);
+            row.setRow(y);
+            for (int x = 0; x < disp.cols; x++) {
+                if (!row.reproject(x, drow[x], out[x]))
+                    out[x] = Vec3f(nan, nan, nan);
+            }
+        }
+    });
+}
+
+void disparityToDepth(const Mat& disp, const Mat& Q, int min_disparity, float max_z, float scale, int type,
+                      Mat& depth)
+{
+    CV_Assert(disp.type() == CV_16SC1 && (type == CV_16U || type == CV_32F));
+
+    const DisparityReprojector reprojector(Q, min_disparity, max_z);
+    depth.create(disp.size(), type);
+
+    parallel_for_(Range(0, disp.rows), [&](const Range& range) {
+        DisparityReprojector row = reprojector;
+        vector<float> zbuf(type == CV_16U ? disp.cols : 0);
+        for (int y = range.start; y < range.end; y++) {
+            row.setRow(y);
+            if (type == CV_32F) {
+                float* out = depth.ptr<float>(y);
+                row.depthRow(disp.ptr<short>(y), disp.cols, out);
+                for (int x = 0; x < disp.cols; x++)
+                    out[x] *= scale;
+            }
+            else {
+                // NaN and out-of-range depths fail the range test and become 0.
+                ushort* out = depth.ptr<ushort>(y);
+                const float* z = zbuf.data();
+                row.depthRow(disp.ptr<short>(y), disp.cols, zbuf.data());
+                for (int x = 0; x < disp.cols; x++) {
+                    float v = z[x] * scale + 0.5f;
+                    bool ok = (v >= 0.5f) & (v < 65535.f);
+                    out[x] = (ushort)(ok ? v : 0.f);
+                }
+            }
+        }
+    });
+}
+
+// Difference between the neighbors of p along one grid direction, or false
+// if neither side is usable. prev/next may be null at the image border.
+static inline bool gridTangent(const Vec3f& p, const Vec3f* prev, const Vec3f* next,
+                               float max_jump, Vec3f& t)
+{
+    bool has_prev = prev && (*prev)[2] == (*prev)[2] && fabsf((*prev)[2] - p[2]) <= max_jump;
+    bool has_next = next && (*next)[2] == (*next)[2] && fabsf((*next)[2] - p[2]) <= max_jump;
+    if (has_prev && has_next)
+        t = *next - *prev;
+    else if (has_next)
+        t = *next - p;
+    else if (has_prev)
+        t = p - *prev;
+    else
+        return false;
+    return true;
+}
+
+void computeGridNormals(const Mat& xyz, Mat& normals, float max_depth_jump)
+{
+    CV_Assert(xyz.type() == CV_32FC3);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    normals.create(xyz.size(), CV_32FC3);
+
+    parallel_for_(Range(0, xyz.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const Vec3f* row = xyz.ptr<Vec3f>(y);
+            const Vec3f* up = y > 0 ? xyz.ptr<Vec3f>(y - 1) : 0;
+            const Vec3f* down = y + 1 < xyz.rows ? xyz.ptr<Vec3f>(y + 1) : 0;
+            Vec3f* out = normals.ptr<Vec3f>(y);
+            for (int x = 0; x < xyz.cols; x++) {
+                const Vec3f& p = row[x];
+                out[x] = Vec3f(nan, nan, nan);
+                if (p[2] != p[2])
+                    continue;
+                float max_jump = max_depth_jump * fabsf(p[2]);
+                Vec3f tx, ty;
+                if (!gridTangent(p, x > 0 ? row + x - 1 : 0, x + 1 < xyz.cols ? row + x + 1 : 0, max_jump, tx) ||
+                    !gridTangent(p, up ? up + x : 0, down ? down + x : 0, max_jump, ty))
+                    continue;
+                Vec3f n = ty.cross(tx);
+                float len = std::sqrt(n.dot(n));
+                if (len < FLT_EPSILON)
+                    continue;
+                // The camera sits at the origin, so a normal facing it points
+                // against the viewing ray p.
+                if (n.dot(p) > 0)
+                    len = -len;
+                out[x] = n * (1.f / len);
+            }
+        }
+    });
+}
+
+// Sum over the box [x0, x1) x [y0, y1) of an integral image.
+template <typename T>
+static inline T boxSum(const Mat& integ, int x0, int y0, int x1, int y1)
+{
+    return integ.at<T>(y1, x1) - integ.at<T>(y0, x1) - integ.at<T>(y1, x0) + integ.at<T>(y0, x0);
+}
+
+// True if p has a valid 4-neighbor within max_step in depth.
+static inline bool hasNearNeighbor(const Mat& xyz, int x, int y, float z, float max_step)
+{
+    static const int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+    for (int i = 0; i < 4; i++) {
+        int nx = x + dx[i], ny = y + dy[i];
+        if (nx < 0 || ny < 0 || nx >= xyz.cols || ny >= xyz.rows)
+            continue;
+        float nz = xyz.at<Vec3f>(ny, nx)[2];
+        if (nz == nz && fabsf(nz - z) <= max_step)
+            return true;
+    }
+    return false;
+}
+
+int filterGridOutliers(Mat& xyz, const GridOutlierParams& params, Mat& rejected)
+{
+    CV_Assert(xyz.type() == CV_32FC3 && params.window >= 3 && params.window % 2 == 1);
+
+    Mat z(xyz.size(), CV_32F), valid(xyz.size(), CV_8U);
+    parallel_for_(Range(0, xyz.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const Vec3f* p = xyz.ptr<Vec3f>(y);
+            float* zrow = z.ptr<float>(y);
+            uchar* vrow = valid.ptr<uchar>(y);
+            for (int x = 0; x < xyz.cols; x++) {
+                vrow[x] = p[x][2] == p[x][2];
+                zrow[x] = vrow[x] ? p[x][2] : 0.f;
+            }
+        }
+    });
+    Mat zsum, zsqsum, count;
+    integral(z, zsum, zsqsum, CV_64F, CV_64F);
+    integral(valid, count, CV_32S);
+
+    const int r = params.window / 2;
+    rejected.create(xyz.size(), CV_8U);
+    parallel_for_(Range(0, xyz.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const float* zrow = z.ptr<float>(y);
+            const uchar* vrow = valid.ptr<uchar>(y);
+            uchar* out = rejected.ptr<uchar>(y);
+            int y0 = std::max(y - r, 0), y1 = std::min(y + r + 1, xyz.rows);
+            for (int x = 0; x < xyz.cols; x++) {
+                out[x] = 0;
+                if (!vrow[x])
+                    continue;
+                int x0 = std::max(x - r, 0), x1 = std::min(x + r + 1, xyz.cols);
+                int n = boxSum<int>(count, x0, y0, x1, y1);
+                float zp = zrow[x];
+                float max_step = params.max_step * fabsf(zp);
+                if (n < params.min_support * (x1 - x0) * (y1 - y0)) {
+                    out[x] = 255;
+                    continue;
+                }
+                double mean = boxSum<double>(zsum, x0, y0, x1, y1) / n;
+                double var = boxSum<double>(zsqsum, x0, y0, x1, y1) / n - mean * mean;
+                double dev = fabs(zp - mean);
+                if ((dev > params.k * std::sqrt(std::max(var, 0.0)) && dev > max_step) ||
+                    !hasNearNeighbor(xyz, x, y, zp, max_step))
+                    out[x] = 255;
+            }
+        }
+    });
+
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    xyz.setTo(Scalar(nan, nan, nan), rejected);
+    return countNonZero(rejected);
+}
+
+bool saveOrganizedPCD(const string& filename, const Mat& xyz, const Mat& color, const Mat& normals)
+{
+    CV_Assert(xyz.type() == CV_32FC3);
+    CV_Assert(color.empty() || (color.size() == xyz.size() && (color.type() == CV_8UC3 || color.type() == CV_8UC1)));
+    CV_Assert(normals.empty() || (normals.size() == xyz.size() && normals.type() == CV_32FC3));
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename.c_str());
+        return false;
+    }
+    const bool has_color = !color.empty(), has_normals = !normals.empty();
+    const int nfields = 3 + (has_color ? 1 : 0) + (has_normals ? 3 : 0);
+    string fields = "x y z", sizes = "4 4 4", types = "F F F", counts = "1 1 1";
+    if (has_color) {
+        fields += " rgb"; sizes += " 4"; types += " U"; counts += " 1";
+    }
+    if (has_normals) {
+        fields += " normal_x normal_y normal_z"; sizes += " 4 4 4"; types += " F F F"; counts += " 1 1 1";
+    }
+    fprintf(fp, "# .PCD v0.7 - Point Cloud Data file format\n"
+        "VERSION 0.7\nFIELDS %s\nSIZE %s\nTYPE %s\nCOUNT %s\n"
+        "WIDTH %d\nHEIGHT %d\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS %d\nDATA binary\n",
+        fields.c_str(), sizes.c_str(), types.c_str(), counts.c_str(),
+        xyz.cols, xyz.rows, xyz.cols * xyz.rows);
+
+    vector<float> buf((size_t)xyz.cols * nfields);
+    bool ok = true;
+    for (int y = 0; ok && y < xyz.rows; y++) {
+        const Vec3f* p = xyz.ptr<Vec3f>(y);
+        const uchar* c = has_color ? color.ptr<uchar>(y) : 0;
+        const Vec3f* n = has_normals ? normals.ptr<Vec3f>(y) : 0;
+        const int cn = has_color ? color.channels() : 0;
+        float* out = buf.data();
+        for (int x = 0; x < xyz.cols; x++) {
+            *out++ = p[x][0]; *out++ = p[x][1]; *out++ = p[x][2];
+            if (has_color) {
+                const uchar* px = c + x * cn;
+                uint32_t rgb = cn == 3 ? ((uint32_t)px[2] << 16 | (uint32_t)px[1] << 8 | px[0])
+                                       : ((uint32_t)px[0] * 0x010101u);
+                memcpy(out++, &rgb, sizeof(rgb));
+            }
+            if (has_normals) {
+                *out++ = n[x][0]; *out++ = n[x][1]; *out++ = n[x][2];
+            }
+        }
+        ok = fwrite(buf.data(), sizeof(float), buf.size(), fp) == buf.size();
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+        printf("Saved organized point cloud to %s\n", filename.c_str());
+    else
+        fprintf(stderr, "Error writing %s\n", filename.c_str());
+    return ok;
+}
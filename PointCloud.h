@@ -0,0 +1,181 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ColoredPoint
+{
+    float x, y, z;
+    uchar r, g, b;
+};
+
+// Applies pose = [R|t] to the position of p.
+inline ColoredPoint transformPoint(const ColoredPoint& p, const cv::Matx34f& T)
+{
+    ColoredPoint q = p;
+    q.x = T(0, 0) * p.x + T(0, 1) * p.y + T(0, 2) * p.z + T(0, 3);
+    q.y = T(1, 0) * p.x + T(1, 1) * p.y + T(1, 2) * p.z + T(1, 3);
+    q.z = T(2, 0) * p.x + T(2, 1) * p.y + T(2, 2) * p.z + T(2, 3);
+    return q;
+}
+
+// Sparse voxel grid that reduces a cloud to one point per occupied voxel: the
+// centroid of the points that fell into it with their mean color. Voxels live
+// in hash maps, so memory follows the occupied surface, not the bounding box.
+//
+// The maps are sharded by voxel key and insert() accumulates the shards in
+// parallel, each shard owned by one thread. insert() may be called repeatedly
+// to stream several clouds into the same grid, e.g. to fuse the clouds of many
+// stereo pairs: overlapping surfaces then merge instead of being duplicated.
+class VoxelGrid
+{
+public:
+    // voxelSize is in the units of the points (those of the calibration).
+    explicit VoxelGrid(float voxelSize);
+
+    void insert(const std::vector<ColoredPoint>& points);
+    // Inserts the points transformed by pose ([R|t], cloud frame to grid
+    // frame) without modifying or copying the input.
+    void insert(const std::vector<ColoredPoint>& points, const cv::Matx34f& pose);
+    void extract(std::vector<ColoredPoint>& points) const;
+
+    size_t size() const;
+    void clear();
+
+private:
+    struct Cell
+    {
+        double x = 0, y = 0, z = 0;
+        uint32_t r = 0, g = 0, b = 0, n = 0;
+    };
+    typedef std::unordered_map<uint64_t, Cell> Shard;
+
+    float voxelSize_;
+    std::vector<Shard> shards_;
+};
+
+// ====================== Organized clouds ======================
+// An organized cloud keeps the pixel grid of the disparity map: a CV_32FC3
+// image of XYZ with NaN marking pixels without a valid point.
+
+// Reprojection of 16-bit fixed-point disparity (4 fractional bits, as produced
+// by StereoBM/StereoSGBM) through Q, shared by everything that turns disparity
+// into points or depth. setRow() hoists the row-constant part of
+// Q * [x y d 1]^T, so a pixel costs a few multiply-adds and one division.
+// Pixels below min_disparity, at infinity or with |z| >= max_z have no point.
+// Each thread works on its own copy.
+class DisparityReprojector
+{
+public:
+    DisparityReprojector(const cv::Mat& Q, int min_disparity, float max_z);
+
+    void setRow(int y)
+    {
+        bx_ = (float)(q_(0, 1) * y + q_(0, 3));
+        by_ = (float)(q_(1, 1) * y + q_(1, 3));
+        bz_ = (float)(q_(2, 1) * y + q_(2, 3));
+        bw_ = (float)(q_(3, 1) * y + q_(3, 3));
+    }
+
+    // Point of pixel x in the current row, or false if it has none.
+    bool reproject(int x, int d16, cv::Vec3f& p) const
+    {
+        float d, iw;
+        if (!scale(x, d16, d, iw))
+            return false;
+        float z = (bz_ + qz0_ * x + qz2_ * d) * iw;
+        if (fabsf(z) >= maxZ_)
+            return false;
+        p = cv::Vec3f((bx_ + qx0_ * x + qx2_ * d) * iw, (by_ + qy0_ * x + qy2_ * d) * iw, z);
+        return true;
+    }
+
+    // Depth of the whole current row: z where reproject() finds a point in
+    // front of the camera, NaN elsewhere. Every pixel is computed and the
+    // validity tests only select the result, so the loop vectorizes.
+    void depthRow(const short* disp, int cols, float* z) const
+    {
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        for (int x = 0; x < cols; x++) {
+            float d = disp[x] * (1.f / 16);
+            float w = bw_ + qw0_ * x + qw2_ * d;
+            float zx = (bz_ + qz0_ * x + qz2_ * d) * (1.f / w);
+            bool valid = (disp[x] >= minD16_) & (fabsf(w) >= FLT_EPSILON) & (fabsf(zx) < maxZ_) & (zx > 0.f);
+            z[x] = valid ? zx : nan;
+        }
+    }
+
+private:
+    bool scale(int x, int d16, float& d, float& iw) const
+    {
+        if (d16 < minD16_)
+            return false;
+        d = d16 * (1.f / 16);
+        float w = bw_ + qw0_ * x + qw2_ * d;
+        if (fabsf(w) < FLT_EPSILON)
+            return false;
+        iw = 1.f / w;
+        return true;
+    }
+
+    cv::Matx44d q_;
+    int minD16_;
+    float maxZ_;
+    float qx0_, qy0_, qz0_, qw0_;   // column 0 of Q (x)
+    float qx2_, qy2_, qz2_, qw2_;   // column 2 of Q (d)
+    float bx_ = 0, by_ = 0, bz_ = 0, bw_ = 0;
+};
+
+// Reprojects 16-bit fixed-point disparity through Q into an organized cloud.
+// Pixels below min_disparity, at infinity or beyond max_z become NaN.
+void reprojectOrganized(const cv::Mat& disp, const cv::Mat& Q, int min_disparity, float max_z,
+                        cv::Mat& xyz);
+
+// Depth image from 16-bit fixed-point disparity, computing only z of the
+// reprojection through Q. Pixels without a point or with z <= 0 are invalid.
+// type CV_16U stores round(z * scale) with 0 for invalid or unrepresentable
+// depths (scale 1 gives millimetres for boards measured in mm); CV_32F stores
+// z * scale with NaN for invalid pixels.
+void disparityToDepth(const cv::Mat& disp, const cv::Mat& Q, int min_disparity, float max_z, float scale,
+                      int type, cv::Mat& depth);
+
+// Per-pixel unit normals from the cross product of the horizontal and vertical
+// neighbor differences, oriented towards the camera. Central differences are
+// used where both neighbors are valid, one-sided ones otherwise. A neighbor
+// whose depth differs by more than max_depth_jump * z is treated as lying on
+// the other side of a depth discontinuity. Pixels without usable neighbors
+// get NaN normals. Rows are processed in parallel in a single pass.
+void computeGridNormals(const cv::Mat& xyz, cv::Mat& normals, float max_depth_jump = 0.05f);
+
+struct GridOutlierParams
+{
+    int window = 7;             // odd side of the statistics window, pixels
+    float k = 3.f;              // allowed deviation from the window mean, in sigmas
+    float max_step = 0.02f;     // depth step to a neighbor, as a fraction of z
+    float min_support = 0.25f;  // fraction of the window that must be valid
+};
+
+// Statistical outlier removal on the pixel grid instead of a k-NN search. The
+// mean and variance of depth in a window around each pixel come from integral
+// images of z, z^2 and the valid count, so the cost does not depend on the
+// window size. A point is rejected when
+//  - less than min_support of its window is valid (isolated specks),
+//  - it deviates from the window mean by more than k sigmas and max_step * z
+//    (spikes on otherwise smooth surfaces), or
+//  - no 4-neighbor lies within max_step * z in depth (flying pixels strung
+//    out across a depth edge).
+// Rejected points are set to NaN in xyz and marked 255 in rejected (CV_8U).
+// Returns the number of rejected points.
+int filterGridOutliers(cv::Mat& xyz, const GridOutlierParams& params, cv::Mat& rejected);
+
+// Writes a binary organized PCD (width x height, NaN for invalid points) with
+// x y z, packed rgb from the BGR/gray color image, and normals if given.
+bool saveOrganizedPCD(const std::string& filename, const cv::Mat& xyz, const cv::Mat& color,
+                      const cv::Mat& normals = cv::Mat());
@@ -0,0 +1,192 @@
+#include "PointCloudSink.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+// Width of the zero-padded PLY vertex count.
+static const int plyCountDigits = 12;
+
+PointCloudSink::PointCloudSink(size_t max_pending_points) : maxPending_(max_pending_points)
+{
+    thread_ = thread(&PointCloudSink::run, this);
+}
+
+PointCloudSink::~PointCloudSink()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (current_) {
+            current_->chunk_count = current_->ready.empty() ? current_->next
+                                                            : std::max(current_->next, current_->ready.rbegin()->first + 1);
+            current_ = nullptr;
+        }
+    }
+    finish();
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+PointCloudSink::Format PointCloudSink::formatFor(const string& filename)
+{
+    size_t dot = filename.find_last_of('.');
+    string ext = dot == string::npos ? string() : filename.substr(dot + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "ply" ? FORMAT_PLY : FORMAT_XYZ;
+}
+
+bool PointCloudSink::open(const string& filename, Format format)
+{
+    unique_lock<mutex> lock(mutex_);
+    CV_Assert(!current_);
+    cond_.wait(lock, [&] { return pending_ <= maxPending_; });
+
+    unique_ptr<File> file(new File);
+    file->filename = filename;
+    file->format = format;
+    file->fp = fopen(filename.c_str(), "wb");
+    if (!file->fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", filename.c_str());
+        ok_ = false;
+        return false;
+    }
+    if (format == FORMAT_PLY) {
+        fprintf(file->fp, "ply\nformat binary_little_endian 1.0\nelement vertex ");
+        file->count_pos = ftell(file->fp);
+        fprintf(file->fp, "%0*d\nproperty float x\nproperty float y\nproperty float z\n"
+            "property uchar red\nproperty uchar green\nproperty uchar blue\nend_header\n", plyCountDigits, 0);
+    }
+    current_ = file.get();
+    files_.push_back(move(file));
+    return true;
+}
+
+void PointCloudSink::write(int chunk, vector<ColoredPoint>&& points)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        CV_Assert(current_);
+        pending_ += points.size();
+        current_->ready[chunk] = move(points);
+    }
+    cond_.notify_all();
+}
+
+void PointCloudSink::close(int chunk_count)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        CV_Assert(current_);
+        current_->chunk_count = chunk_count;
+        current_ = nullptr;
+    }
+    cond_.notify_all();
+}
+
+bool PointCloudSink::finish()
+{
+    unique_lock<mutex> lock(mutex_);
+    // Only the file still open, if any, may remain queued.
+    cond_.wait(lock, [&] { return files_.empty() || (files_.size() == 1 && files_.front().get() == current_); });
+    bool ok = ok_;
+    ok_ = true;
+    return ok;
+}
+
+void PointCloudSink::run()
+{
+    vector<char> buf;
+    unique_lock<mutex> lock(mutex_);
+    for (;;) {
+        cond_.wait(lock, [&] {
+            if (stop_ || files_.empty())
+                return stop_;
+            const File& f = *files_.front();
+            return f.next == f.chunk_count || f.ready.count(f.next) != 0;
+        });
+        if (files_.empty())
+            return;
+
+        File& f = *files_.front();
+        if (f.next == f.chunk_count) {
+            lock.unlock();
+            bool ok = finishFile(f);
+            lock.lock();
+            ok_ = ok_ && ok;
+            files_.pop_front();
+            cond_.notify_all();
+            continue;
+        }
+
+        // Take every chunk that is next in order and write them unlocked.
+        vector<vector<ColoredPoint> > batch;
+        for (auto it = f.ready.find(f.next); it != f.ready.end() && it->first == f.next; it = f.ready.find(f.next)) {
+            batch.push_back(move(it->second));
+            f.ready.erase(it);
+            f.next++;
+        }
+        lock.unlock();
+        size_t written = 0;
+        for (const vector<ColoredPoint>& points : batch) {
+            if (f.ok)
+                f.ok = writeChunk(f, points, buf);
+            written += points.size();
+        }
+        batch.clear();
+        lock.lock();
+        pending_ -= written;
+        cond_.notify_all();
+    }
+}
+
+bool PointCloudSink::writeChunk(File& file, const vector<ColoredPoint>& points, vector<char>& buf)
+{
+    buf.clear();
+    if (file.format == FORMAT_PLY) {
+        const size_t vsize = 3 * sizeof(float) + 3;
+        buf.resize(points.size() * vsize);
+        char* out = buf.data();
+        for (const ColoredPoint& p : points) {
+            memcpy(out, &p.x, sizeof(float));
+            memcpy(out + 4, &p.y, sizeof(float));
+            memcpy(out + 8, &p.z, sizeof(float));
+            out[12] = (char)p.r;
+            out[13] = (char)p.g;
+            out[14] = (char)p.b;
+            out += vsize;
+        }
+    }
+    else {
+        char line[128];
+        buf.reserve(points.size() * 48);
+        for (const ColoredPoint& p : points) {
+            int n = snprintf(line, sizeof(line), "%f %f %f %d %d %d\n", p.x, p.y, p.z, p.r, p.g, p.b);
+            buf.insert(buf.end(), line, line + n);
+        }
+    }
+    file.points += points.size();
+    return buf.empty() || fwrite(buf.data(), 1, buf.size(), file.fp) == buf.size();
+}
+
+bool PointCloudSink::finishFile(File& file)
+{
+    bool ok = file.ok;
+    if (ok && file.format == FORMAT_PLY) {
+        ok = fseek(file.fp, file.count_pos, SEEK_SET) == 0 &&
+            fprintf(file.fp, "%0*llu", plyCountDigits, (unsigned long long)file.points) == plyCountDigits;
+    }
+    ok = fclose(file.fp) == 0 && ok;
+    file.fp = nullptr;
+    if (ok)
+        printf("Saved colored point cloud to %s (%llu points)\n", file.filename.c_str(), (unsigned long long)file.points);
+    else
+        fprintf(stderr, "Error writing %s\n", file.filename.c_str());
+    return ok;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "PointCloud.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Asynchronous point cloud writer. Files are written by one background thread
+// while the caller goes on with the next pair.
+//
+// A file is opened, receives numbered chunks, and is closed with the number of
+// chunks it got. Chunks may arrive from any thread in any order; the writer
+// puts them into the file in chunk order as soon as the next one is there and
+// formats them outside the lock, so producers only ever wait for the mutex.
+// write() never blocks, which keeps parallel producers free of ordering
+// deadlocks; instead open() waits until the queued points drop below
+// max_pending_points, which bounds memory to that plus one file's worth.
+//
+// PLY files get a fixed-width vertex count in the header that is patched when
+// the file is complete, so the count need not be known up front.
+class PointCloudSink
+{
+public:
+    enum Format { FORMAT_XYZ, FORMAT_PLY };
+
+    explicit PointCloudSink(size_t max_pending_points = 8u << 20);
+    ~PointCloudSink();
+    PointCloudSink(const PointCloudSink&) = delete;
+    PointCloudSink& operator=(const PointCloudSink&) = delete;
+
+    // FORMAT_PLY for a .ply extension, FORMAT_XYZ otherwise.
+    static Format formatFor(const std::string& filename);
+
+    bool open(const std::string& filename, Format format);
+    void write(int chunk, std::vector<ColoredPoint>&& points);
+    void close(int chunk_count);
+    // Waits until every closed file is on disk. Returns false if any open or
+    // write failed since the last call.
+    bool finish();
+
+private:
+    struct File
+    {
+        std::string filename;
+        FILE* fp = nullptr;
+        Format format = FORMAT_XYZ;
+        long count_pos = -1;        // offset of the PLY vertex count
+        std::map<int, std::vector<ColoredPoint> > ready;
+        int next = 0;
+        int chunk_count = -1;       // unknown until close()
+        uint64_t points = 0;
+        bool ok = true;
+    };
+
+    void run();
+    static bool writeChunk(File& file, const std::vector<ColoredPoint>& points, std::vector<char>& buf);
+    static bool finishFile(File& file);
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::unique_ptr<File> > files_;
+    File* current_ = nullptr;
+    size_t pending_ = 0;
+    size_t maxPending_;
+    bool stop_ = false;
+    bool ok_ = true;
+    std::thread thread_;
+};
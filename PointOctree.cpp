@@ -0,0 +1,328 @@
+#include "PointOctree.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+
+using namespace cv;
+using namespace std;
+
+static const char octreeMagic[8] = { 'S', 'T', 'O', 'C', 'T', 'R', 'E', 'E' };
+static const size_t spillChunk = 1 << 20;
+static const size_t partitionBuffer = 1 << 16;
+
+static_assert(sizeof(OctreeFileHeader) == 56, "octree header layout");
+static_assert(sizeof(OctreeNodeEntry) == 32, "octree node entry layout");
+static_assert(sizeof(OctreePointRecord) == 16, "octree point layout");
+
+static inline int childIndex(const ColoredPoint& p, const Vec3d& center)
+{
+    return (p.x >= center[0] ? 1 : 0) | (p.y >= center[1] ? 2 : 0) | (p.z >= center[2] ? 4 : 0);
+}
+
+OctreeWriter::~OctreeWriter()
+{
+    discard();
+}
+
+bool OctreeWriter::open(const string& dir)
+{
+    discard();
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    if (ec) {
+        fprintf(stderr, "Failed to create octree directory %s: %s\n", dir.c_str(), ec.message().c_str());
+        return false;
+    }
+    dir_ = dir;
+    spill_ = fopen(spillName(0, 0).c_str(), "wb");
+    data_ = fopen((filesystem::path(dir_) / "octree.bin").string().c_str(), "wb");
+    if (!spill_ || !data_) {
+        fprintf(stderr, "Failed to open octree files in %s\n", dir.c_str());
+        discard();
+        return false;
+    }
+    count_ = 0;
+    spillOk_ = true;
+    written_ = 0;
+    nodes_.clear();
+    min_ = Vec3d::all(DBL_MAX);
+    max_ = Vec3d::all(-DBL_MAX);
+    buffer_.reserve(spillChunk);
+    return true;
+}
+
+void OctreeWriter::add(const vector<ColoredPoint>& points, const Matx34f& pose)
+{
+    if (!spill_)
+        return;
+    for (const ColoredPoint& src : points) {
+        ColoredPoint p = transformPoint(src, pose);
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+            continue;
+        min_[0] = std::min(min_[0], (double)p.x); max_[0] = std::max(max_[0], (double)p.x);
+        min_[1] = std::min(min_[1], (double)p.y); max_[1] = std::max(max_[1], (double)p.y);
+        min_[2] = std::min(min_[2], (double)p.z); max_[2] = std::max(max_[2], (double)p.z);
+        buffer_.push_back(p);
+        if (buffer_.size() >= spillChunk)
+            flushSpill();
+    }
+}
+
+bool OctreeWriter::flushSpill()
+{
+    if (!buffer_.empty() && fwrite(buffer_.data(), sizeof(ColoredPoint), buffer_.size(), spill_) != buffer_.size())
+        spillOk_ = false;
+    count_ += buffer_.size();
+    buffer_.clear();
+    return spillOk_;
+}
+
+bool OctreeWriter::close()
+{
+    if (!spill_)
+        return false;
+    bool ok = flushSpill();
+    ok = fclose(spill_) == 0 && ok;
+    spill_ = nullptr;
+
+    Cube root;
+    root.origin = count_ ? min_ : Vec3d();
+    root.size = 0;
+    for (int i = 0; i < 3; i++)
+        root.size = std::max(root.size, max_[i] - min_[i]);
+    // Grow the cube slightly so the points on the max faces fall inside.
+    root.size = count_ ? root.size * (1 + 1e-6) + 1e-6 : 1;
+
+    vector<ColoredPoint> lod;
+    if (ok && count_)
+        ok = buildFromFile(0, 0, root, count_, lod);
+    else
+        remove(spillName(0, 0).c_str());
+    ok = fclose(data_) == 0 && ok;
+    data_ = nullptr;
+    ok = ok && writeIndex(root);
+    if (ok)
+        printf("Saved octree (%llu points, %d nodes) to %s\n", (unsigned long long)count_, (int)nodes_.size(),
+               dir_.c_str());
+    else
+        fprintf(stderr, "Error writing octree to %s\n", dir_.c_str());
+    return ok;
+}
+
+string OctreeWriter::spillName(uint32_t level, uint64_t path) const
+{
+    char name[64];
+    snprintf(name, sizeof(name), "spill_%u_%llx.tmp", level, (unsigned long long)path);
+    return (filesystem::path(dir_) / name).string();
+}
+
+bool OctreeWriter::buildFromFile(uint32_t level, uint64_t path, const Cube& cube, size_t count,
+                                 vector<ColoredPoint>& lod)
+{
+    const string name = spillName(level, path);
+    FILE* in = fopen(name.c_str(), "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s\n", name.c_str());
+        return false;
+    }
+
+    if (count <= params_.memory_points || (int)level >= params_.max_depth) {
+        vector<ColoredPoint> points(count);
+        bool ok = fread(points.data(), sizeof(ColoredPoint), count, in) == count;
+        fclose(in);
+        remove(name.c_str());
+        return ok && buildInMemory(level, path, cube, points.data(), count, lod);
+    }
+
+    // Too large for memory: split the spill file by octant and recurse.
+    const double half = cube.size * 0.5;
+    const Vec3d center = cube.origin + Vec3d::all(half);
+    FILE* out[8] = {};
+    vector<ColoredPoint> pending[8];
+    size_t counts[8] = {};
+    bool ok = true;
+    for (int c = 0; ok && c < 8; c++) {
+        out[c] = fopen(spillName(level + 1, path << 3 | c).c_str(), "wb");
+        ok = out[c] != nullptr;
+        pending[c].reserve(partitionBuffer);
+    }
+    vector<ColoredPoint> chunk(spillChunk);
+    for (size_t done = 0; ok && done < count;) {
+        size_t n = std::min(spillChunk, count - done);
+        ok = fread(chunk.data(), sizeof(ColoredPoint), n, in) == n;
+        for (size_t i = 0; ok && i < n; i++) {
+            int c = childIndex(chunk[i], center);
+            pending[c].push_back(chunk[i]);
+            if (pending[c].size() == partitionBuffer) {
+                ok = fwrite(pending[c].data(), sizeof(ColoredPoint), partitionBuffer, out[c]) == partitionBuffer;
+                counts[c] += partitionBuffer;
+                pending[c].clear();
+            }
+        }
+        done += n;
+    }
+    fclose(in);
+    remove(name.c_str());
+    vector<ColoredPoint>().swap(chunk);
+    for (int c = 0; c < 8; c++) {
+        if (!out[c])
+            continue;
+        ok = ok && (pending[c].empty() ||
+            fwrite(pending[c].data(), sizeof(ColoredPoint), pending[c].size(), out[c]) == pending[c].size());
+        counts[c] += pending[c].size();
+        vector<ColoredPoint>().swap(pending[c]);
+        ok = fclose(out[c]) == 0 && ok;
+    }
+
+    vector<ColoredPoint> child_lod;
+    unordered_set<uint64_t> taken;
+    uint32_t mask = 0;
+    lod.clear();
+    for (int c = 0; c < 8; c++) {
+        if (!ok || !counts[c]) {
+            remove(spillName(level + 1, path << 3 | c).c_str());
+            continue;
+        }
+        Cube child;
+        child.size = half;
+        child.origin = cube.origin + Vec3d(c & 1 ? half : 0, c & 2 ? half : 0, c & 4 ? half : 0);
+        ok = buildFromFile(level + 1, path << 3 | c, child, counts[c], child_lod);
+        if (ok)
+            sampleLod(child_lod.data(), child_lod.size(), cube, taken, lod);
+        mask |= 1u << c;
+    }
+    if (!ok)
+        return false;
+    return writeNode(level, path, mask, lod.data(), lod.size());
+}
+
+bool OctreeWriter::buildInMemory(uint32_t level, uint64_t path, const Cube& cube, ColoredPoint* points,
+                                 size_t count, vector<ColoredPoint>& lod)
+{
+    if (count <= params_.node_capacity || (int)level >= params_.max_depth) {
+        unordered_set<uint64_t> taken;
+        lod.clear();
+        sampleLod(points, count, cube, taken, lod);
+        return writeNode(level, path, 0, points, count);
+    }
+
+    // In-place partition into the eight octants, ordered by child index.
+    const double half = cube.size * 0.5;
+    const Vec3d center = cube.origin + Vec3d::all(half);
+    ColoredPoint* bounds[9];
+    bounds[0] = points;
+    bounds[8] = points + count;
+    bounds[4] = std::partition(bounds[0], bounds[8], [&](const ColoredPoint& p) { return p.z < center[2]; });
+    for (int z = 0; z < 8; z += 4)
+        bounds[z + 2] = std::partition(bounds[z], bounds[z + 4], [&](const ColoredPoint& p) { return p.y < center[1]; });
+    for (int zy = 0; zy < 8; zy += 2)
+        bounds[zy + 1] = std::partition(bounds[zy], bounds[zy + 2], [&](const ColoredPoint& p) { return p.x < center[0]; });
+
+    vector<ColoredPoint> child_lod;
+    unordered_set<uint64_t> taken;
+    uint32_t mask = 0;
+    lod.clear();
+    for (int c = 0; c < 8; c++) {
+        size_t n = bounds[c + 1] - bounds[c];
+        if (!n)
+            continue;
+        Cube child;
+        child.size = half;
+        child.origin = cube.origin + Vec3d(c & 1 ? half : 0, c & 2 ? half : 0, c & 4 ? half : 0);
+        if (!buildInMemory(level + 1, path << 3 | c, child, bounds[c], n, child_lod))
+            return false;
+        sampleLod(child_lod.data(), child_lod.size(), cube, taken, lod);
+        mask |= 1u << c;
+    }
+    return writeNode(level, path, mask, lod.data(), lod.size());
+}
+
+// Appends to lod the first point that falls into each cell of a lod_grid^3
+// grid over the cube that is not yet in taken, so the LODs of several children
+// can be merged one after the other.
+void OctreeWriter::sampleLod(const ColoredPoint* points, size_t count, const Cube& cube,
+                             unordered_set<uint64_t>& taken, vector<ColoredPoint>& lod) const
+{
+    const int grid = params_.lod_grid;
+    const double scale = grid / cube.size;
+    taken.reserve(std::min(taken.size() + count, (size_t)grid * grid * 4));
+    for (size_t i = 0; i < count; i++) {
+        const ColoredPoint& p = points[i];
+        uint64_t ix = (uint64_t)std::min(std::max((int)((p.x - cube.origin[0]) * scale), 0), grid - 1);
+        uint64_t iy = (uint64_t)std::min(std::max((int)((p.y - cube.origin[1]) * scale), 0), grid - 1);
+        uint64_t iz = (uint64_t)std::min(std::max((int)((p.z - cube.origin[2]) * scale), 0), grid - 1);
+        if (taken.insert(ix | iy << 21 | iz << 42).second)
+            lod.push_back(p);
+    }
+}
+
+bool OctreeWriter::writeNode(uint32_t level, uint64_t path, uint32_t childMask, const ColoredPoint* points,
+                             size_t count)
+{
+    OctreeNodeEntry e;
+    e.path = path;
+    e.level = level;
+    e.childMask = childMask;
+    e.offset = written_;
+    e.count = count;
+    nodes_.push_back(e);
+
+    vector<OctreePointRecord> records(std::min(count, partitionBuffer));
+    for (size_t i = 0; i < count; i += records.size()) {
+        size_t n = std::min(records.size(), count - i);
+        for (size_t k = 0; k < n; k++) {
+            const ColoredPoint& p = points[i + k];
+            OctreePointRecord& r = records[k];
+            r.x = p.x; r.y = p.y; r.z = p.z;
+            r.r = p.r; r.g = p.g; r.b = p.b; r.pad = 0;
+        }
+        if (fwrite(records.data(), sizeof(OctreePointRecord), n, data_) != n)
+            return false;
+    }
+    written_ += count;
+    return true;
+}
+
+bool OctreeWriter::writeIndex(const Cube& root)
+{
+    sort(nodes_.begin(), nodes_.end(), [](const OctreeNodeEntry& a, const OctreeNodeEntry& b) {
+        return a.level != b.level ? a.level < b.level : a.path < b.path;
+    });
+
+    OctreeFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, octreeMagic, sizeof(octreeMagic));
+    header.version = formatVersion;
+    header.nodeCount = (uint32_t)nodes_.size();
+    for (int i = 0; i < 3; i++)
+        header.origin[i] = root.origin[i];
+    header.size = root.size;
+    header.lodGrid = (uint32_t)params_.lod_grid;
+    header.pointBytes = sizeof(OctreePointRecord);
+
+    const string name = (filesystem::path(dir_) / "octree.idx").string();
+    FILE* fp = fopen(name.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        (nodes_.empty() || fwrite(nodes_.data(), sizeof(OctreeNodeEntry), nodes_.size(), fp) == nodes_.size());
+    return fclose(fp) == 0 && ok;
+}
+
+void OctreeWriter::discard()
+{
+    if (spill_) {
+        fclose(spill_);
+        spill_ = nullptr;
+        remove(spillName(0, 0).c_str());
+    }
+    if (data_) {
+        fclose(data_);
+        data_ = nullptr;
+    }
+    vector<ColoredPoint>().swap(buffer_);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "PointCloud.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct OctreeParams
+{
+    size_t node_capacity = 100000;      // points per leaf before it is split
+    int lod_grid = 128;                 // LOD cells per axis of an inner node
+    size_t memory_points = 8u << 20;    // points one subtree may hold in memory
+    int max_depth = 20;
+};
+
+// On-disk records, little-endian.
+struct OctreeFileHeader
+{
+    char magic[8];              // "STOCTREE"
+    uint32_t version;
+    uint32_t nodeCount;
+    double origin[3];           // root cube min corner
+    double size;                // root cube edge length
+    uint32_t lodGrid;
+    uint32_t pointBytes;        // sizeof(OctreePointRecord)
+};
+
+struct OctreeNodeEntry
+{
+    uint64_t path;              // 3 bits per level below the root, child x | y << 1 | z << 2
+    uint32_t level;
+    uint32_t childMask;         // bit i set if child i exists
+    uint64_t offset;            // first point in octree.bin
+    uint64_t count;
+};
+
+struct OctreePointRecord
+{
+    float x, y, z;
+    uint8_t r, g, b, pad;
+};
+
+// Out-of-core octree for point sets too large to load at once. The layout is
+// two files in one directory:
+//
+//   octree.idx  OctreeFileHeader, then one OctreeNodeEntry per node sorted
+//               by (level, path)
+//   octree.bin  the point blocks of all nodes, OctreePointRecord each
+//
+// Leaves hold the original points. Every inner node holds a level-of-detail
+// sample of its subtree, one point per cell of a lod_grid^3 grid over the
+// node cube, so a viewer refines by replacing a node with its children and
+// can stop at any depth or region.
+//
+// add() only appends to a spill file, so any number of pairs can be streamed
+// in. close() then partitions the spill file by octant until a subtree fits
+// in memory_points, builds that subtree in memory and appends its nodes to
+// octree.bin, leaves first. An inner node merges the LOD samples of its
+// children into its own as each child is finished, so memory use stays bounded
+// by memory_points plus one LOD sample (at most lod_grid^3 points, in practice
+// roughly the lod_grid^2 cells a surface crosses) per level of the current
+// path. The spill files are removed as they are consumed.
+class OctreeWriter
+{
+public:
+    static const uint32_t formatVersion = 1;
+
+    explicit OctreeWriter(const OctreeParams& params = OctreeParams()) : params_(params) {}
+    ~OctreeWriter();
+    OctreeWriter(const OctreeWriter&) = delete;
+    OctreeWriter& operator=(const OctreeWriter&) = delete;
+
+    bool open(const std::string& dir);
+    // Appends the points transformed by pose ([R|t], cloud frame to octree frame).
+    void add(const std::vector<ColoredPoint>& points, const cv::Matx34f& pose = cv::Matx34f::eye());
+    bool close();
+
+private:
+    struct Cube
+    {
+        cv::Vec3d origin;
+        double size;
+    };
+
+    bool flushSpill();
+    std::string spillName(uint32_t level, uint64_t path) const;
+    bool buildFromFile(uint32_t level, uint64_t path, const Cube& cube, size_t count,
+                       std::vector<ColoredPoint>& lod);
+    bool buildInMemory(uint32_t level, uint64_t path, const Cube& cube, ColoredPoint* points, size_t count,
+                       std::vector<ColoredPoint>& lod);
+    void sampleLod(const ColoredPoint* points, size_t count, const Cube& cube, std::unordered_set<uint64_t>& taken,
+                   std::vector<ColoredPoint>& lod) const;
+    bool writeNode(uint32_t level, uint64_t path, uint32_t childMask, const ColoredPoint* points, size_t count);
+    bool writeIndex(const Cube& root);
+    void discard();
+
+    OctreeParams params_;
+    std::string dir_;
+    FILE* spill_ = nullptr;
+    FILE* data_ = nullptr;
+    std::vector<ColoredPoint> buffer_;
+    size_t count_ = 0;
+    bool spillOk_ = true;
+    cv::Vec3d min_, max_;
+    uint64_t written_ = 0;
+    std::vector<OctreeNodeEntry> nodes_;
+};
@@ -6,7 +6,12 @@
 #include "opencv2/videoio.hpp"
 #include "opencv2/highgui.hpp"
 #include <opencv2/objdetect/charuco_detector.hpp>
+#include "CornerCache.h"
+#include "CalibPreview.h"
+#include "UndistortMaps.h"
+#include "ViewRejection.h"
 
+#include <algorithm>
 #include <cctype>
 #include <stdio.h>
 #include <string.h>
@@ -86,6 +91,14 @@ static void help(char** argv)
         "     [-cy=<Y center point>]   # camera center point in Y-dir as an initial intrinsic guess (if this flag is used, fx, fy, cx, cy must be set)\n"
         "     [-imshow-scale           # image resize scaling factor when displaying the results (must be >= 1)\n"
         "     [-enable-k3=<0/1>        # to enable (1) or disable (0) K3 coefficient for the distortion model\n"
+        "     [-cache=<filename>]      # corner detection cache for image lists; detections are reused\n"
+        "                              # on reruns as long as the images and board settings are unchanged\n"
+        "     [-headless]              # no windows and no key waits; with a live camera capturing starts\n"
+        "                              # immediately instead of waiting for 'g'\n"
+        "     [-preview-dir=<dir>]     # write the preview images to <dir> as PNG instead of showing them\n"
+        "     [-om=<filename>]         # save the undistortion maps of the result (e.g. maps.yml.gz)\n"
+        "     [-reject=<k>]            # drop views whose reprojection error exceeds median + k*MAD and\n"
+        "                              # recalibrate until no view is rejected (0 disables, 3 is typical)\n"
         "     [-dt=<distance>]         # actual distance between top-left and top-right corners of\n"
         "                              # the calibration grid. If this parameter is specified, a more\n"
         "                              # accurate calibration method will be used which may be better\n"
@@ -161,10 +174,10 @@ static void calcChessboardCorners(Size boardSize, float squareSize, vector<Point
     }
 }
 
-static bool runCalibration( vector<vector<Point2f> > imagePoints,
+static bool runCalibration( vector<vector<Point2f> >& imagePoints,
                     Size imageSize, Size boardSize, Pattern patternType,
                     float squareSize, float aspectRatio,
-                    float grid_width, bool release_object,
+                    float grid_width, bool release_object, float rejectK,
                     int flags, Mat& cameraMatrix, Mat& distCoeffs,
                     vector<Mat>& rvecs, vector<Mat>& tvecs,
                     vector<float>& reprojErrs,
@@ -181,6 +194,7 @@ static bool runCalibration( vector<vector<Point2f> > imagePoints,
     int offset = patternType != CHARUCOBOARD ? boardSize.width - 1: boardSize.width - 2;
     objectPoints[0][offset].x = objectPoints[0][0].x + grid_width;
     newObjPoints = objectPoints[0];
+    vector<Point3f> boardPoints = objectPoints[0];
 
     objectPoints.resize(imagePoints.size(),objectPoints[0]);
 
@@ -208,6 +222,54 @@ static bool runCalibration( vector<vector<Point2f> > imagePoints,
     totalAvgErr = computeReprojectionErrors(objectPoints, imagePoints,
                 rvecs, tvecs, cameraMatrix, distCoeffs, reprojErrs);
 
+    // Outlier rejection: drop the views far above the robust error threshold
+    // and re-solve from the current intrinsics, which converges in a few
+    // iterations instead of a full solve from scratch each time.
+    vector<int> viewIds(imagePoints.size());
+    for( size_t v = 0; v < viewIds.size(); v++ )
+        viewIds[v] = (int)v;
+    for( int iter = 0; ok && rejectK > 0 && iter < 5; iter++ )
+    {
+        float threshold = (float)robustErrorThreshold(vector<double>(reprojErrs.begin(), reprojErrs.end()), rejectK);
+        vector<int> keep;
+        for( size_t v = 0; v < reprojErrs.size(); v++ )
+            if( reprojErrs[v] <= threshold )
+                keep.push_back((int)v);
+        if( keep.size() == imagePoints.size() || keep.size() < 4 )
+            break;
+
+        printf("Rejecting %d of %d views above %.4f px:", (int)(imagePoints.size() - keep.size()),
+               (int)imagePoints.size(), threshold);
+        vector<vector<Point2f> > keptPoints;
+        vector<int> keptIds;
+        for( size_t v = 0, kk = 0; v < imagePoints.size(); v++ )
+        {
+            if( kk < keep.size() && keep[kk] == (int)v )
+            {
+                keptPoints.push_back(imagePoints[v]);
+                keptIds.push_back(viewIds[v]);
+                kk++;
+            }
+            else
+                printf(" %d", viewIds[v]);
+        }
+        printf("\n");
+        imagePoints.swap(keptPoints);
+        viewIds.swap(keptIds);
+
+        objectPoints.assign(imagePoints.size(), boardPoints);
+        newObjPoints = boardPoints;
+        rms = calibrateCameraRO(objectPoints, imagePoints, imageSize, iFixedPoint,
+                                cameraMatrix, distCoeffs, rvecs, tvecs, newObjPoints,
+                                flags | CALIB_USE_INTRINSIC_GUESS | CALIB_USE_LU);
+        printf("RMS error after rejection pass %d: %g\n", iter + 1, rms);
+        ok = checkRange(cameraMatrix) && checkRange(distCoeffs);
+
+        objectPoints.assign(imagePoints.size(), newObjPoints);
+        totalAvgErr = computeReprojectionErrors(objectPoints, imagePoints,
+                    rvecs, tvecs, cameraMatrix, distCoeffs, reprojErrs);
+    }
+
     return ok;
 }
 
@@ -336,7 +398,7 @@ static bool readStringList( const string& filename, vector<string>& l )
 static bool runAndSave(const string& outputFilename,
                 const vector<vector<Point2f> >& imagePoints,
                 Size imageSize, Size boardSize, Pattern patternType, float squareSize,
-                float grid_width, bool release_object,
+                float grid_width, bool release_object, float rejectK,
                 float aspectRatio, int flags, Mat& cameraMatrix,
                 Mat& distCoeffs, bool writeExtrinsics, bool writePoints, bool writeGrid )
 {
@@ -344,9 +406,10 @@ static bool runAndSave(const string& outputFilename,
     vector<float> reprojErrs;
     double totalAvgErr = 0;
     vector<Point3f> newObjPoints;
+    vector<vector<Point2f> > usedPoints(imagePoints);
 
-    bool ok = runCalibration(imagePoints, imageSize, boardSize, patternType, squareSize,
-                   aspectRatio, grid_width, release_object, flags, cameraMatrix, distCoeffs,
+    bool ok = runCalibration(usedPoints, imageSize, boardSize, patternType, squareSize,
+                   aspectRatio, grid_width, release_object, rejectK, flags, cameraMatrix, distCoeffs,
                    rvecs, tvecs, reprojErrs, newObjPoints, totalAvgErr);
     printf("%s. avg reprojection error = %.7f\n",
            ok ? "Calibration succeeded" : "Calibration failed",
@@ -359,7 +422,7 @@ static bool runAndSave(const string& outputFilename,
                          writeExtrinsics ? rvecs : vector<Mat>(),
                          writeExtrinsics ? tvecs : vector<Mat>(),
                          writeExtrinsics ? reprojErrs : vector<float>(),
-                         writePoints ? imagePoints : vector<vector<Point2f> >(),
+                         writePoints ? usedPoints : vector<vector<Point2f> >(),
                          writeGrid ? newObjPoints : vector<Point3f>(),
                          totalAvgErr );
     return ok;
@@ -394,7 +457,7 @@ int main6( int argc, char** argv )
     cv::CommandLineParser parser(argc, argv,
         "{help ||}{w||}{h||}{pt|chessboard|}{n|10|}{d|1000|}{s|1|}{ms|0.5|}{ad|DICT_4X4_50|}{adf|None|}{o|out_camera_data.yml|}"
         "{op||}{oe||}{zt||}{a||}{p||}{v||}{V||}{su||}"
-        "{oo||}{ws|11|}{dt||}"
+        "{oo||}{ws|11|}{dt||}{cache||}{reject|0|}{headless||}{preview-dir||}{om||}"
         "{fx||}{fy||}{cx||}{cy||}"
         "{imshow-scale|1|}{enable-k3|0|}"
         "{@input_data|0|}");
@@ -474,6 +537,12 @@ int main6( int argc, char** argv )
     else
         inputFilename = parser.get<string>("@input_data");
     int winSize = parser.get<int>("ws");
+    string cacheFilename = parser.get<string>("cache");
+    float rejectK = parser.get<float>("reject");
+    string previewDir = parser.get<string>("preview-dir");
+    string mapsFilename = parser.get<string>("om");
+    PreviewSink::Mode previewMode = !previewDir.empty() ? PreviewSink::DISK :
+        parser.has("headless") ? PreviewSink::NONE : PreviewSink::WINDOW;
     cameraMatrix = Mat::eye(3, 3, CV_64F);
     if (parser.has("fx") && parser.has("fy") && parser.has("cx") && parser.has("cy"))
     {
@@ -510,6 +579,8 @@ int main6( int argc, char** argv )
         return printf("Invalid number of images\n" ), -1;
     if ( aspectRatio <= 0 )
         return printf( "Invalid aspect ratio\n" ), -1;
+    if ( rejectK < 0 )
+        return printf( "Invalid rejection threshold\n" ), -1;
     if ( delay <= 0 )
         return printf( "Invalid delay\n" ), -1;
     if ( boardSize.width <= 0 )
@@ -533,6 +604,12 @@ int main6( int argc, char** argv )
     std::vector<int> markerIds;
     cv::aruco::CharucoDetector ch_detector(ch_board);
 
+    CornerCache cache(cacheFilename);
+    string detectParams = format("single|%d|%dx%d|flip%d|ws%d", (int)pattern,
+        boardSize.width, boardSize.height, (int)flipVertical, winSize);
+    if (pattern == CHARUCOBOARD)
+        detectParams += format("|%g|%g|%d|%s", squareSize, markerSize, arucoDict, dictFilename.c_str());
+
     if( !inputFilename.empty() )
     {
         if( !videofile && readStringList(samples::findFile(inputFilename), imageList) )
@@ -549,15 +626,24 @@ int main6( int argc, char** argv )
     if( !imageList.empty() )
         nframes = (int)imageList.size();
 
+    PreviewSink preview(previewMode, previewDir);
+    UndistortMaps undistortMaps;
     if( capture.isOpened() )
-        printf( "%s", liveCaptureHelp );
+    {
+        if( preview.mode() == PreviewSink::WINDOW )
+            printf( "%s", liveCaptureHelp );
+        else
+            mode = CAPTURING;
+    }
 
-    namedWindow( "Image View", 1 );
+    if( preview.mode() == PreviewSink::WINDOW )
+        namedWindow( "Image View", 1 );
 
     for(i = 0;;i++)
     {
         Mat view, viewGray;
         bool blink = false;
+        string cacheKey;
 
         if( capture.isOpened() )
         {
@@ -566,15 +652,21 @@ int main6( int argc, char** argv )
             view0.copyTo(view);
         }
         else if( i < (int)imageList.size() )
-            view = imread(imageList[i], IMREAD_COLOR);
+        {
+            vector<uchar> bytes;
+            if( cache.enabled() )
+                cacheKey = CornerCache::fileKey(imageList[i], detectParams, bytes);
+            view = bytes.empty() ? imread(imageList[i], IMREAD_COLOR) : imdecode(bytes, IMREAD_COLOR);
+        }
 
         if(view.empty())
         {
-            if( imagePoints.size() > 0 )
+            if( imagePoints.size() > 0 &&
                 runAndSave(outputFilename, imagePoints, imageSize,
-                           boardSize, pattern, squareSize, grid_width, release_object, aspectRatio,
+                           boardSize, pattern, squareSize, grid_width, release_object, rejectK, aspectRatio,
                            flags, cameraMatrix, distCoeffs,
-                           writeExtrinsics, writePoints, writeGrid);
+                           writeExtrinsics, writePoints, writeGrid) )
+                undistortMaps.build(cameraMatrix, distCoeffs, imageSize, 1, 1.0/viewScaleFactor);
             break;
         }
 
@@ -587,31 +679,50 @@ int main6( int argc, char** argv )
         cvtColor(view, viewGray, COLOR_BGR2GRAY);
 
         bool found;
-        switch( pattern )
+        CornerCache::Entry cached;
+        if( !cacheKey.empty() && cache.lookup(cacheKey, cached) )
         {
-            case CHESSBOARD:
-                found = findChessboardCorners( view, boardSize, pointbuf,
-                    CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_FAST_CHECK | CALIB_CB_NORMALIZE_IMAGE);
-                break;
-            case CIRCLES_GRID:
-                found = findCirclesGrid( view, boardSize, pointbuf );
-                break;
-            case ASYMMETRIC_CIRCLES_GRID:
-                found = findCirclesGrid( view, boardSize, pointbuf, CALIB_CB_ASYMMETRIC_GRID );
-                break;
-            case CHARUCOBOARD:
+            found = cached.found;
+            pointbuf = cached.corners;
+            markerIds = cached.ids;
+        }
+        else
+        {
+            switch( pattern )
             {
-                ch_detector.detectBoard(view, pointbuf, markerIds);
-                found = pointbuf.size() == (size_t)(boardSize.width-1)*(boardSize.height-1);
-                break;
+                case CHESSBOARD:
+                    found = findChessboardCorners( view, boardSize, pointbuf,
+                        CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_FAST_CHECK | CALIB_CB_NORMALIZE_IMAGE);
+                    break;
+                case CIRCLES_GRID:
+                    found = findCirclesGrid( view, boardSize, pointbuf );
+                    break;
+                case ASYMMETRIC_CIRCLES_GRID:
+                    found = findCirclesGrid( view, boardSize, pointbuf, CALIB_CB_ASYMMETRIC_GRID );
+                    break;
+                case CHARUCOBOARD:
+                {
+                    ch_detector.detectBoard(view, pointbuf, markerIds);
+                    found = pointbuf.size() == (size_t)(boardSize.width-1)*(boardSize.height-1);
+                    break;
+                }
+                default:
+                    return fprintf( stderr, "Unknown pattern type\n" ), -1;
             }
-            default:
-                return fprintf( stderr, "Unknown pattern type\n" ), -1;
-        }
 
-       // improve the found corners' coordinate accuracy
-        if( pattern == CHESSBOARD && found) cornerSubPix( viewGray, pointbuf, Size(winSize,winSize),
-            Size(-1,-1), TermCriteria( TermCriteria::EPS+TermCriteria::COUNT, 30, 0.0001 ));
+           // improve the found corners' coordinate accuracy
+            if( pattern == CHESSBOARD && found) cornerSubPix( viewGray, pointbuf, Size(winSize,winSize),
+                Size(-1,-1), TermCriteria( TermCriteria::EPS+TermCriteria::COUNT, 30, 0.0001 ));
+
+            if( !cacheKey.empty() )
+            {
+                cached.found = found;
+                cached.imageSize = view.size();
+                cached.corners = pointbuf;
+                cached.ids = pattern == CHARUCOBOARD ? markerIds : vector<int>();
+                cache.store(cacheKey, cached);
+            }
+        }
 
         if( mode == CAPTURING && found &&
            (!capture.isOpened() || clock() - prevTimestamp > delay*1e-3*CLOCKS_PER_SEC) )
@@ -621,52 +732,56 @@ int main6( int argc, char** argv )
             blink = capture.isOpened();
         }
 
-        if(found)
+        char key = -1;
+        if( preview.active() )
         {
-            if(pattern != CHARUCOBOARD)
-                drawChessboardCorners( view, boardSize, Mat(pointbuf), found );
-            else
-                drawChessboardCorners( view, Size(boardSize.width-1, boardSize.height-1), Mat(pointbuf), found );
-        }
+            if(found)
+            {
+                if(pattern != CHARUCOBOARD)
+                    drawChessboardCorners( view, boardSize, Mat(pointbuf), found );
+                else
+                    drawChessboardCorners( view, Size(boardSize.width-1, boardSize.height-1), Mat(pointbuf), found );
+            }
 
-        string msg = mode == CAPTURING ? "100/100" :
-            mode == CALIBRATED ? "Calibrated" : "Press 'g' to start";
-        int baseLine = 0;
-        Size textSize = getTextSize(msg, 1, 1, 1, &baseLine);
-        Point textOrigin(view.cols - 2*textSize.width - 10, view.rows - 2*baseLine - 10);
+            string msg = mode == CAPTURING ? "100/100" :
+                mode == CALIBRATED ? "Calibrated" : "Press 'g' to start";
+            int baseLine = 0;
+            Size textSize = getTextSize(msg, 1, 1, 1, &baseLine);
+            Point textOrigin(view.cols - 2*textSize.width - 10, view.rows - 2*baseLine - 10);
 
-        if( mode == CAPTURING )
-        {
-            if(undistortImage)
-                msg = cv::format( "%d/%d Undist", (int)imagePoints.size(), nframes );
-            else
-                msg = cv::format( "%d/%d", (int)imagePoints.size(), nframes );
-        }
+            if( mode == CAPTURING )
+            {
+                if(undistortImage)
+                    msg = cv::format( "%d/%d Undist", (int)imagePoints.size(), nframes );
+                else
+                    msg = cv::format( "%d/%d", (int)imagePoints.size(), nframes );
+            }
 
-        putText( view, msg, textOrigin, 1, 1,
-                 mode != CALIBRATED ? Scalar(0,0,255) : Scalar(0,255,0));
+            putText( view, msg, textOrigin, 1, 1,
+                     mode != CALIBRATED ? Scalar(0,0,255) : Scalar(0,255,0));
 
-        if( blink )
-            bitwise_not(view, view);
+            if( blink )
+                bitwise_not(view, view);
 
-        if( mode == CALIBRATED && undistortImage )
-        {
-            Mat temp = view.clone();
-            undistort(temp, view, cameraMatrix, distCoeffs);
-        }
-        if (viewScaleFactor > 1)
-        {
-            Mat viewScale;
-            resize(view, viewScale, Size(), 1.0/viewScaleFactor, 1.0/viewScaleFactor, INTER_AREA);
-            imshow("Image View", viewScale);
-        }
-        else
-        {
-            imshow("Image View", view);
+            if( mode == CALIBRATED && undistortImage )
+            {
+                // The preview maps undistort and downscale in one remap.
+                Mat undistorted;
+                undistortMaps.applyPreview(view, undistorted);
+                key = (char)preview.show("Image View", undistorted, capture.isOpened() ? 50 : 500);
+            }
+            else if (viewScaleFactor > 1)
+            {
+                Mat viewScale;
+                resize(view, viewScale, Size(), 1.0/viewScaleFactor, 1.0/viewScaleFactor, INTER_AREA);
+                key = (char)preview.show("Image View", viewScale, capture.isOpened() ? 50 : 500);
+            }
+            else
+            {
+                key = (char)preview.show("Image View", view, capture.isOpened() ? 50 : 500);
+            }
         }
 
-        char key = (char)waitKey(capture.isOpened() ? 50 : 500);
-
         if( key == 27 )
             break;
 
@@ -682,41 +797,36 @@ int main6( int argc, char** argv )
         if( mode == CAPTURING && imagePoints.size() >= (unsigned)nframes )
         {
             if( runAndSave(outputFilename, imagePoints, imageSize,
-                       boardSize, pattern, squareSize, grid_width, release_object, aspectRatio,
+                       boardSize, pattern, squareSize, grid_width, release_object, rejectK, aspectRatio,
                        flags, cameraMatrix, distCoeffs,
                        writeExtrinsics, writePoints, writeGrid))
+            {
                 mode = CALIBRATED;
+                undistortMaps.build(cameraMatrix, distCoeffs, imageSize, 1, 1.0/viewScaleFactor);
+            }
             else
                 mode = DETECTION;
-            if( !capture.isOpened() )
+            if( !capture.isOpened() || preview.mode() != PreviewSink::WINDOW )
                 break;
         }
     }
 
-    if( !capture.isOpened() && showUndistorted )
+    cache.save();
+
+    if( !mapsFilename.empty() && !undistortMaps.empty() )
+        undistortMaps.save(mapsFilename);
+
+    if( !capture.isOpened() && showUndistorted && preview.active() && !undistortMaps.empty() )
     {
-        Mat view, rview, map1, map2;
-        initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(),
-                                getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, imageSize, 1, imageSize, 0),
-                                imageSize, CV_16SC2, map1, map2);
+        Mat view, rview;
 
         for( i = 0; i < (int)imageList.size(); i++ )
         {
             view = imread(imageList[i], IMREAD_COLOR);
             if(view.empty())
                 continue;
-            remap(view, rview, map1, map2, INTER_LINEAR);
-            if (viewScaleFactor > 1)
-            {
-                Mat rviewScale;
-                resize(rview, rviewScale, Size(), 1.0/viewScaleFactor, 1.0/viewScaleFactor, INTER_AREA);
-                imshow("Image View", rviewScale);
-            }
-            else
-            {
-                imshow("Image View", rview);
-            }
-            char c = (char)waitKey();
+            undistortMaps.applyPreview(view, rview);
+            char c = (char)preview.show("Undistorted", rview, 0);
             if( c == 27 || c == 'q' || c == 'Q' )
                 break;
         }
@@ -0,0 +1,72 @@
+#include "UndistortMaps.h"
+
+#include "opencv2/calib3d.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <stdio.h>
+
+using namespace cv;
+using namespace std;
+
+void UndistortMaps::build(const Mat& cameraMatrix, const Mat& distCoeffs, Size imageSize,
+                          double alpha, double previewScale)
+{
+    imageSize_ = imageSize;
+    cameraMatrix.copyTo(cameraMatrix_);
+    distCoeffs.copyTo(distCoeffs_);
+    newCameraMatrix_ = getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, imageSize, alpha, imageSize, 0);
+    initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), newCameraMatrix_,
+                            imageSize, CV_16SC2, map1_, map2_);
+
+    previewMap1_.release();
+    previewMap2_.release();
+    if (previewScale > 0 && previewScale < 1)
+    {
+        // Scaling the new camera matrix (principal point included) maps the
+        // same field of view onto the smaller output.
+        Mat previewCamera = newCameraMatrix_.clone();
+        Mat focalRows = previewCamera.rowRange(0, 2);
+        focalRows *= previewScale;
+        Size previewSize(cvRound(imageSize.width * previewScale), cvRound(imageSize.height * previewScale));
+        initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), previewCamera,
+                                previewSize, CV_16SC2, previewMap1_, previewMap2_);
+    }
+}
+
+void UndistortMaps::apply(const Mat& src, Mat& dst) const
+{
+    CV_Assert(!empty() && src.size() == imageSize_);
+    remap(src, dst, map1_, map2_, INTER_LINEAR);
+}
+
+void UndistortMaps::applyPreview(const Mat& src, Mat& dst) const
+{
+    if (!hasPreview())
+    {
+        apply(src, dst);
+        return;
+    }
+    CV_Assert(src.size() == imageSize_);
+    remap(src, dst, previewMap1_, previewMap2_, INTER_LINEAR);
+}
+
+bool UndistortMaps::save(const string& filename) const
+{
+    if (empty())
+        return false;
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        fprintf(stderr, "Could not write undistortion maps %s\n", filename.c_str());
+        return false;
+    }
+    fs << "image_width" << imageSize_.width;
+    fs << "image_height" << imageSize_.height;
+    fs << "camera_matrix" << cameraMatrix_;
+    fs << "distortion_coefficients" << distCoeffs_;
+    fs << "new_camera_matrix" << newCameraMatrix_;
+    fs << "map1" << map1_;
+    fs << "map2" << map2_;
+    printf("Saved undistortion maps to %s\n", filename.c_str());
+    return true;
+}
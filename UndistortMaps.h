@@ -0,0 +1,41 @@
+#pragma once
+
+#include "opencv2/core.hpp"
+
+#include <string>
+
+// Undistortion maps for one calibration result. They are built once, in the
+// fixed-point CV_16SC2/CV_16UC1 layout remap() is fastest with, instead of
+// letting undistort() recompute them for every frame. An optional preview
+// variant remaps straight to a reduced output size, so a scaled-down display
+// costs one remap and no extra resize.
+class UndistortMaps
+{
+public:
+    // alpha is passed to getOptimalNewCameraMatrix (0 = only valid pixels,
+    // 1 = keep every source pixel). previewScale in (0, 1) also builds the
+    // reduced-size maps; 1 skips them.
+    void build(const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, cv::Size imageSize,
+               double alpha, double previewScale = 1.0);
+
+    bool empty() const { return map1_.empty(); }
+    bool hasPreview() const { return !previewMap1_.empty(); }
+    cv::Size imageSize() const { return imageSize_; }
+    const cv::Mat& newCameraMatrix() const { return newCameraMatrix_; }
+
+    // src must have the size the maps were built for. applyPreview() falls
+    // back to apply() when no preview maps exist.
+    void apply(const cv::Mat& src, cv::Mat& dst) const;
+    void applyPreview(const cv::Mat& src, cv::Mat& dst) const;
+
+    // Writes the calibration and the full-size maps with FileStorage so other
+    // tools can remap without the calibration code; use a .yml.gz or .xml.gz
+    // name to keep the file small.
+    bool save(const std::string& filename) const;
+
+private:
+    cv::Size imageSize_;
+    cv::Mat cameraMatrix_, distCoeffs_, newCameraMatrix_;
+    cv::Mat map1_, map2_;
+    cv::Mat previewMap1_, previewMap2_;
+};
@@ -0,0 +1,19 @@
+#include "ViewRejection.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+double robustErrorThreshold(const vector<double>& errors, double k)
+{
+    vector<double> v(errors);
+    size_t mid = v.size() / 2;
+    nth_element(v.begin(), v.begin() + mid, v.end());
+    double median = v[mid];
+    for (size_t i = 0; i < v.size(); i++)
+        v[i] = fabs(v[i] - median);
+    nth_element(v.begin(), v.begin() + mid, v.end());
+    double mad = 1.4826 * v[mid];
+    return median + k * max(mad, 0.1 * median);
+}
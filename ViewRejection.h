@@ -0,0 +1,9 @@
+#pragma once
+
+#include <vector>
+
+// Per-view error threshold used by the calibration tools to reject outlier
+// views: median + k * MAD, with the MAD scaled to a standard deviation. A
+// floor of 10% of the median keeps a set of nearly identical errors from
+// rejecting views over noise. errors must not be empty.
+double robustErrorThreshold(const std::vector<double>& errors, double k);
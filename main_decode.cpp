@@ -42,6 +42,7 @@
 #include <opencv2/structured_light.hpp>
 #include "opencv2/structured_light/graycodepattern.hpp"
 #include <fstream>
+#include "CalibBundle.h"
 
 using namespace cv;
 using namespace std;
@@ -51,7 +52,8 @@ using namespace std;
 "{@images_list     |         | Image list where the captured pattern images are saved}"
 "{@proj_width      |         | The projector width used to acquire the pattern          }"
 "{@proj_height     |         | The projector height used to acquire the pattern}"
-"{calib_param_path |         | Calibration_parameters          }"
+"{calib_param_path |         | Calibration bundle (calib_bundle.bin); images are rectified before decoding}"
+"{camera           |0        | Bundle camera the images come from (0 = left, 1 = right)}"
 "{mask             |mask.png | Output mask image filename      }"
 "{x_png            |x.png    | X decoded image filename (8bit) }"
 "{y_png            |y.png    | Y decoded image filename (8bit) }"
@@ -181,12 +183,50 @@ int main4(int argc, char* argv[])
 	
 	const vector<string> image_list    = getStringList(images_file);
 
-	const Mat1b white_image      = imread(image_list[num_pattern],     IMREAD_GRAYSCALE);
-	const Mat1b black_image      = imread(image_list[num_pattern + 1], IMREAD_GRAYSCALE);
-	const Mat1b shadow_mask      = computeShadowMask(black_image, white_image, black_thresh);
+	vector<Mat1b> captured_pattern = getImags(image_list);
 
+	// Decode in rectified coordinates when a calibration bundle is given. The
+	// bundle is memory-mapped, so its maps are used without any setup cost.
+	const string calib_path = parser.get<string>("calib_param_path");
+	if (!calib_path.empty()) {
+		CalibBundle bundle;
+		if (!bundle.load(calib_path)) {
+			cerr << "Failed to load calibration bundle " << calib_path << endl;
+			return -1;
+		}
+		const int camera = parser.get<int>("camera");
+		if (camera != 0 && camera != 1) {
+			cerr << "--camera must be 0 (left) or 1 (right)" << endl;
+			return -1;
+		}
+		const Mat& map1 = camera == 0 ? bundle.map11 : bundle.map21;
+		const Mat& map2 = camera == 0 ? bundle.map12 : bundle.map22;
+		if (map1.empty() || map2.empty()) {
+			cerr << "Calibration bundle " << calib_path << " has no rectification maps for camera " << camera << endl;
+			return -1;
+		}
+		// Rectifying only some of the frames would decode a mix of both
+		// geometries, so every image must match the calibrated size.
+		for (size_t i = 0; i < captured_pattern.size(); ++i) {
+			if (captured_pattern[i].size() != bundle.imageSize) {
+				cerr << "Image " << image_list[i] << " is " << captured_pattern[i].cols << "x"
+				     << captured_pattern[i].rows << ", the calibration bundle is for "
+				     << bundle.imageSize.width << "x" << bundle.imageSize.height << endl;
+				return -1;
+			}
+		}
+		parallel_for_(Range(0, (int)captured_pattern.size()), [&](const Range& range) {
+			for (int i = range.start; i < range.end; ++i) {
+				Mat1b rectified;
+				remap(captured_pattern[i], rectified, map1, map2, INTER_LINEAR);
+				captured_pattern[i] = rectified;
+			}
+		});
+	}
 
-	const vector<Mat1b> captured_pattern = getImags(image_list);
+	const Mat1b white_image      = captured_pattern[num_pattern];
+	const Mat1b black_image      = captured_pattern[num_pattern + 1];
+	const Mat1b shadow_mask      = computeShadowMask(black_image, white_image, black_thresh);
 
 	cout << endl << "Decoding pattern ..." << endl;
 	Mat2f decodedImage = computeDecodeImage(graycode, captured_pattern, shadow_mask);